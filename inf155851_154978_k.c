@@ -7,19 +7,47 @@
 #include <sys/msg.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "inf155851_154978_mqipc.h"
 
+#define SEND_RETRIES 3        // retries of throttled message
+#define SEND_BACKOFF 100000   // first retry delay (us), doubled on each retry
+#define TRACE_ROOMS 32        // rooms checked for missing messages
+
 int *cmsgid = 0;  // client message queue id
 int shared;       // shared memory id
+mqipc_routing *routing = NULL;  // server routing table, NULL when not attached
 char username[32];
 char blocklist[32][32];  // list of blocked users
+msg_send_message pending[MQIPC_BATCH_SIZE / sizeof(msg_batch_entry)];  // messages unpacked from batch frame
+int pendingCount = 0;
+int showLatency = 0;  // print stage latencies of received messages
+
+/// @brief Sequence numbers seen in room, messages of higher priority overtake others.
+typedef struct room_trace {
+    char room_name[32];
+    unsigned int first;     // lowest sequence number seen since server numbered room
+    unsigned int highest;   // highest sequence number seen
+    unsigned int received;  // messages received
+    unsigned int missing;   // missing messages already reported
+} room_trace;
+
+room_trace traces[TRACE_ROOMS];
+int traceCount = 0;
 
 void printError(char *msg) {
     fprintf(stderr, "%s\nError: %s\n", msg, strerror(errno));
 }
 
+/// @brief Monotonic clock in microseconds, same clock as server timestamps.
+long long nowUsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 void blockUser() {
     // user input
     char user[32];
@@ -71,6 +99,30 @@ int connectToServer() {
     return msgid;
 }
 
+/// @brief Finds queue of the server shard owning room.
+/// @param msgid Queue of shard 0 returned by connectToServer().
+/// @param room_name Room name.
+/// @return Queue owning room, shard 0 queue when server has no routing table.
+int connectToRoom(int msgid, char *room_name) {
+    // attach routing table again after server restart
+    if (routing && routing->queues[0] != msgid) {
+        shmdt(routing);
+        routing = NULL;
+    }
+    if (!routing) {
+        int id = shmget(MQIPC_SERVER, 0, 0);
+        if (id == -1) {
+            return msgid;
+        }
+        routing = shmat(id, NULL, SHM_RDONLY);
+        if (routing == (void *)-1) {
+            routing = NULL;
+            return msgid;
+        }
+    }
+    return routing->queues[mqipcShard(routing, room_name)];
+}
+
 int login() {
     // connect to server
     int msgid = connectToServer();
@@ -94,11 +146,13 @@ int login() {
         printError("Failed to create message queue.");
         return 0;
     }
+    login.pid = getpid();
+    login.flags = MQIPC_LOGIN_BATCH;
     // send login message
-    msgsnd(msgid, &login, sizeof(msg_login), 0);
+    mqipcSendLogin(msgid, &login, 0);
     // wait for server to respond
     msg_response response;
-    msgrcv(login.cmsgid, &response, sizeof(msg_response), M_RESPONSE, 0);
+    mqipcReceiveResponse(login.cmsgid, &response, 0);
     // print server response
     printf("Server response: %s\n", response.message);
     if (response.status == M_SUCCESS) {
@@ -121,7 +175,7 @@ void logout() {
     logout.mtype = M_LOGOUT;
     logout.cmsgid = *cmsgid;
     // send logout message
-    msgsnd(msgid, &logout, sizeof(msg_logout), 0);
+    mqipcSendLogout(msgid, &logout, 0);
     // delete user queue
     msgctl(*cmsgid, IPC_RMID, NULL);
     return;
@@ -147,10 +201,11 @@ void createRoom() {
         printf("Invalid room name.\n");
     }
     // send create room message
-    msgsnd(msgid, &create_room, sizeof(msg_create_room), 0);
+    msgid = connectToRoom(msgid, create_room.room_name);
+    mqipcSendCreateRoom(msgid, &create_room, 0);
     // wait for server to respond
     msg_response response;
-    msgrcv(*cmsgid, &response, sizeof(msg_response), M_RESPONSE, 0);
+    mqipcReceiveResponse(*cmsgid, &response, 0);
     // print server response
     printf("Server response: %s\n", response.message);
 }
@@ -165,15 +220,20 @@ void listRooms() {
     msg_list_rooms list_rooms;
     list_rooms.mtype = M_LIST_ROOMS;
     list_rooms.cmsgid = *cmsgid;
-    // send list rooms message
-    msgsnd(msgid, &list_rooms, sizeof(msg_list_rooms), 0);
-    // wait for server to respond
-    msg_response response;
-    while (1) {
-        msgrcv(*cmsgid, &response, sizeof(msg_response), M_RESPONSE, 0);
-        printf("Server response: %s\n", response.message);
-        if (response.status != M_MORE) {
-            break;
+    // every shard lists its own rooms
+    connectToRoom(msgid, "");
+    int shards = routing ? routing->shards : 1;
+    for (int i = 0; i < shards; i++) {
+        // send list rooms message
+        mqipcSendListRooms(routing ? routing->queues[i] : msgid, &list_rooms, 0);
+        // wait for server to respond
+        msg_response response;
+        while (1) {
+            mqipcReceiveResponse(*cmsgid, &response, 0);
+            printf("Server response: %s\n", response.message);
+            if (response.status != M_MORE) {
+                break;
+            }
         }
     }
 }
@@ -219,10 +279,11 @@ void joinRoom() {
     }
     join_room.subscribtion++;
     // send join room message
-    msgsnd(msgid, &join_room, sizeof(msg_join_room), 0);
+    msgid = connectToRoom(msgid, join_room.room_name);
+    mqipcSendJoinRoom(msgid, &join_room, 0);
     // wait for server to respond
     msg_response response;
-    msgrcv(*cmsgid, &response, sizeof(msg_response), M_RESPONSE, 0);
+    mqipcReceiveResponse(*cmsgid, &response, 0);
     // print server response
     printf("Server response: %s\n", response.message);
 }
@@ -234,6 +295,7 @@ void sendMessage() {
         return;
     }
     msg_send_message msg;
+    memset(&msg, 0, sizeof(msg));
     msg.mtype = M_SEND_MESSAGE;
     strcpy(msg.author, username);
     msg.cmsgid = *cmsgid;
@@ -269,21 +331,150 @@ void sendMessage() {
         }
         break;
     }
-    // send message
-    msgsnd(msgid, &msg, sizeof(msg_send_message), 0);
-    // wait for server to respond
+    msgid = connectToRoom(msgid, msg.room_name);
     msg_response response;
-    msgrcv(*cmsgid, &response, sizeof(msg_response), M_RESPONSE, 0);
+    // back off and retry while server throttles sending
+    for (int retry = 0; retry <= SEND_RETRIES; retry++) {
+        if (retry) {
+            printf("Server response: %s Retrying.\n", response.message);
+            usleep(SEND_BACKOFF << (retry - 1));
+        }
+        // send message
+        msg.stamps[MQIPC_PUBLISHED] = nowUsec();
+        mqipcSendSendMessage(msgid, &msg, 0);
+        // wait for server to respond
+        mqipcReceiveResponse(*cmsgid, &response, 0);
+        if (response.status != M_THROTTLED) {
+            break;
+        }
+    }
     // print server response
     printf("Server response: %s\n", response.message);
 }
 
+void unpackBatch(msg_batch *batch) {
+    char *pos = batch->data;
+    for (int i = 0; i < batch->count; i++) {
+        msg_batch_entry entry;
+        memcpy(&entry, pos, sizeof(entry));
+        pos += sizeof(entry);
+        msg_send_message *msg = &pending[pendingCount++];
+        msg->mtype = entry.priority;
+        msg->priority = entry.priority;
+        msg->cmsgid = 0;
+        msg->sequence = entry.sequence;
+        memcpy(msg->stamps, entry.stamps, sizeof(msg->stamps));
+        memcpy(msg->author, pos, entry.author_length);
+        msg->author[entry.author_length] = '\0';
+        pos += entry.author_length;
+        memcpy(msg->room_name, pos, entry.room_length);
+        msg->room_name[entry.room_length] = '\0';
+        pos += entry.room_length;
+        memcpy(msg->message, pos, entry.message_length);
+        msg->message[entry.message_length] = '\0';
+        pos += entry.message_length;
+    }
+}
+
+/// @brief Receives next message, unpacking batch frames sent by the server.
+/// @param msg Received message.
+/// @param flags msgrcv flags.
+/// @return 0 on success, -1 if no message was received.
+int receiveMessage(msg_send_message *msg, int flags) {
+    if (!pendingCount) {
+        union {
+            msg_send_message msg;
+            msg_batch batch;
+        } frame;
+        if (msgrcv(*cmsgid, &frame, sizeof(frame) - sizeof(long), -10, flags) == -1) {
+            return -1;
+        }
+        if (frame.msg.cmsgid != MQIPC_BATCH_FRAME) {
+            *msg = frame.msg;
+            return 0;
+        }
+        unpackBatch(&frame.batch);
+    }
+    // take the most urgent unpacked message, oldest first
+    int next = 0;
+    for (int i = 1; i < pendingCount; i++) {
+        if (pending[i].priority < pending[next].priority) {
+            next = i;
+        }
+    }
+    *msg = pending[next];
+    memmove(&pending[next], &pending[next + 1], (pendingCount - next - 1) * sizeof(msg_send_message));
+    pendingCount--;
+    return 0;
+}
+
+/// @brief Records received message and reports missing messages. Messages of higher priority
+/// overtake others, so numbers count as missing only once nothing is left to receive.
+/// @param msg Received message, blocked authors included.
+void traceSequence(msg_send_message *msg) {
+    room_trace *trace = NULL;
+    for (int i = 0; i < traceCount; i++) {
+        if (strcmp(traces[i].room_name, msg->room_name) == 0) {
+            trace = &traces[i];
+            break;
+        }
+    }
+    if (!trace) {
+        if (traceCount == TRACE_ROOMS) {
+            return;
+        }
+        trace = &traces[traceCount++];
+        strcpy(trace->room_name, msg->room_name);
+    }
+    if (!trace->received || msg->sequence == 1) {
+        // first message or server restarted and numbers rooms again
+        trace->first = trace->highest = msg->sequence;
+        trace->received = trace->missing = 0;
+    }
+    if (msg->sequence < trace->first) {
+        trace->first = msg->sequence;  // overtaken message
+    }
+    if (msg->sequence > trace->highest) {
+        trace->highest = msg->sequence;
+    }
+    trace->received++;
+    // messages still queued may fill gaps
+    struct msqid_ds ds;
+    if (pendingCount || msgctl(*cmsgid, IPC_STAT, &ds) == -1 || ds.msg_qnum) {
+        return;
+    }
+    for (int i = 0; i < traceCount; i++) {
+        trace = &traces[i];
+        unsigned int missing = trace->highest - trace->first + 1 - trace->received;
+        if (missing > trace->missing) {
+            printf("! %u messages missing in %s\n", missing - trace->missing, trace->room_name);
+        }
+        trace->missing = missing;
+    }
+}
+
+/// @brief Prints time received message spent in each pipeline stage.
+/// @param msg Received message.
+/// @param now Time message was received (us).
+void printLatency(msg_send_message *msg, long long now) {
+    long long *stamps = msg->stamps;
+    printf("  #%u latency (us): server queue %lld, server %lld, fan-out %lld, subscriber queue %lld, total %lld\n", msg->sequence,
+           stamps[MQIPC_RECEIVED] - stamps[MQIPC_PUBLISHED], stamps[MQIPC_FANOUT] - stamps[MQIPC_RECEIVED],
+           stamps[MQIPC_ENQUEUED] - stamps[MQIPC_FANOUT], now - stamps[MQIPC_ENQUEUED], now - stamps[MQIPC_PUBLISHED]);
+}
+
 void readMessage() {
     msg_send_message msg;
+    long long now;
     do {
-        msgrcv(*cmsgid, &msg, sizeof(msg_send_message), -10, 0);
+        receiveMessage(&msg, 0);
+        now = nowUsec();
+        traceSequence(&msg);
     } while (isBlocked(msg.author));
     printf("> %s@%s said: %s\n", msg.author, msg.room_name, msg.message);
+    if (showLatency) {
+        printLatency(&msg, now);
+    }
 }
 
 void exitHandler(int sig) {
@@ -304,10 +495,14 @@ void asyncRead() {
     msg_send_message msg;
     while (1) {
         if (*cmsgid > 0) {
-            if (msgrcv(*cmsgid, &msg, sizeof(msg_send_message), -10, IPC_NOWAIT) != -1) {
+            if (receiveMessage(&msg, IPC_NOWAIT) != -1) {
+                long long now = nowUsec();
+                traceSequence(&msg);
                 if (isBlocked(msg.author))
                     continue;
                 printf("> %s@%s said: %s\n", msg.author, msg.room_name, msg.message);
+                if (showLatency)
+                    printLatency(&msg, now);
             }
         }
     }
@@ -322,11 +517,16 @@ pid_t turnAsyncRead() {
         asyncRead();
         exit(0);
     }
+    // unpacked messages are printed by async reader
+    pendingCount = 0;
     return pid;
 }
 
 int main(int argc, char const *argv[]) {
     printf("Welcome to Message Queue IPC Client\n");
+    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+        showLatency = 1;
+    }
     signal(SIGINT, exitHandler);
     shared = shmget(IPC_PRIVATE, sizeof(cmsgid), 0666 | IPC_CREAT);
     if (shared == -1) {
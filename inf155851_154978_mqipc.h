@@ -1,8 +1,50 @@
 #ifndef MQIPC_H
 #define MQIPC_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/msg.h>
+
 #define MQIPC_SERVER 1337
 #define MQIPC_MESSAGE_SIZE 256
+#define MQIPC_BATCH_SIZE 4096  // max packed bytes in batch frame
+#define MQIPC_BATCH_FRAME -1   // cmsgid of delivered message marking a batch frame
+#define MQIPC_LOGIN_BATCH 1    // login flag, client accepts batch frames
+#define MQIPC_MAX_SHARDS 16    // server processes at most
+#define MQIPC_RING_POINTS 64   // points of each shard on the routing ring
+#define MQIPC_MAX_PAYLOAD 8192  // default msgmax, largest message a queue accepts
+#define MQIPC_MAX_PRIORITY 10   // messages have priority 1 (most urgent) to 10
+
+// Pipeline stages timed in every published message, CLOCK_MONOTONIC microseconds
+enum mqipc_stamp {
+    MQIPC_PUBLISHED = 0,  // client sent message to server
+    MQIPC_RECEIVED = 1,   // room shard received message
+    MQIPC_FANOUT = 2,     // server started delivering to subscribers
+    MQIPC_ENQUEUED = 3,   // server sent message to subscriber
+    MQIPC_STAMPS = 4,
+};
+
+// Request trace written by server capture mode: mqipc_trace_header, then for every
+// client request handled a mqipc_trace_record followed by the request including its
+// mtype, sized by mqipcPayloads. Every shard writes its own file.
+#define MQIPC_TRACE_MAGIC 0x5254514d  // "MQTR"
+#define MQIPC_TRACE_VERSION 1
+
+typedef struct mqipc_trace_header {
+    uint32_t magic;    // MQIPC_TRACE_MAGIC
+    uint32_t version;  // MQIPC_TRACE_VERSION
+    int shard;         // shard that handled the requests
+    int shards;        // shards of the captured server
+} mqipc_trace_header;
+
+typedef struct mqipc_trace_record {
+    long long time;   // request taken by shard, CLOCK_MONOTONIC microseconds
+    uint32_t length;  // request bytes following the record
+} mqipc_trace_record;
+
+// Socket gateway: clients connected to the server Unix socket or loopback TCP port
+// exchange the same messages as over queues, each framed as a uint32_t length
+// followed by the message including its mtype. Server fills in client cmsgid.
 
 typedef struct msg_response {
     long mtype;
@@ -14,6 +56,8 @@ typedef struct msg_login {
     long mtype;
     int cmsgid;         // client cmsgid
     char username[32];  // client username
+    int pid;            // client process id
+    int flags;          // MQIPC_LOGIN_* flags
 } msg_login;
 
 typedef struct msg_logout {
@@ -47,23 +91,146 @@ typedef struct msg_send_message {
     char room_name[32];                // room name
     char message[MQIPC_MESSAGE_SIZE];  // message
     int priority;                      // priority
+    unsigned int sequence;             // per room message number, set by server
+    long long stamps[MQIPC_STAMPS];    // mqipc_stamp times
 } msg_send_message;
 
+// Packed message inside batch frame, followed by author, room name and message without terminators
+typedef struct msg_batch_entry {
+    int priority;                   // priority
+    unsigned char author_length;    // author length
+    unsigned char room_length;      // room name length
+    unsigned short message_length;  // message length
+    unsigned int sequence;          // per room message number
+    long long stamps[MQIPC_STAMPS];  // mqipc_stamp times
+} msg_batch_entry;
+
+typedef struct msg_batch {
+    long mtype;                   // highest priority of packed messages
+    int cmsgid;                   // MQIPC_BATCH_FRAME
+    int count;                    // packed messages
+    int length;                   // bytes used in data
+    char data[MQIPC_BATCH_SIZE];  // packed messages
+} msg_batch;
+
+typedef struct mqipc_ring_point {
+    unsigned int hash;  // position on the ring
+    int shard;          // shard owning rooms hashed up to this position
+} mqipc_ring_point;
+
+// Routing table in shared memory at key MQIPC_SERVER, maps rooms to server shards
+typedef struct mqipc_routing {
+    int shards;                    // number of shards
+    int queues[MQIPC_MAX_SHARDS];  // shard queues, shard 0 owns key MQIPC_SERVER
+    int points;                    // ring points used
+    mqipc_ring_point ring[MQIPC_MAX_SHARDS * MQIPC_RING_POINTS];  // sorted by hash
+} mqipc_routing;
+
+static inline unsigned int mqipcHash(const char *name) {
+    // FNV-1a with a final mix, spreads similar names over the ring
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/// @brief Finds shard owning room: first ring point at or after room hash.
+static inline int mqipcShard(const mqipc_routing *routing, const char *room_name) {
+    unsigned int hash = mqipcHash(room_name);
+    int low = 0, high = routing->points;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (routing->ring[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return routing->ring[low == routing->points ? 0 : low].shard;
+}
+
 enum msg_response_status {
     M_SUCCESS = 0,
     M_FAIL = 1,
     M_MORE = 2,
+    M_THROTTLED = 3,  // rate limit exceeded, retry later
+    M_LIMITED = 4,    // server limit reached, request refused
 };
 
+// Message catalogue, X(type, value, layout, name). Types, payload sizes, checks and
+// send and receive functions below are generated from it.
+// Requests sent to the server, each starts with client cmsgid.
+#define MQIPC_REQUESTS(X)                                \
+    X(M_LOGIN, 2, msg_login, Login)                      \
+    X(M_LOGOUT, 3, msg_logout, Logout)                   \
+    X(M_CREATE_ROOM, 4, msg_create_room, CreateRoom)     \
+    X(M_LIST_ROOMS, 5, msg_list_rooms, ListRooms)        \
+    X(M_JOIN_ROOM, 6, msg_join_room, JoinRoom)           \
+    X(M_SEND_MESSAGE, 7, msg_send_message, SendMessage)
+// Replies sent to clients. Delivered messages are msg_send_message or msg_batch with priority as mtype.
+#define MQIPC_REPLIES(X) \
+    X(M_RESPONSE, 1, msg_response, Response)
+
 enum msg_type {
-    M_RESPONSE = 1,
-    M_LOGIN = 2,
-    M_LOGOUT = 3,
-    M_CREATE_ROOM = 4,
-    M_LIST_ROOMS = 5,
-    M_JOIN_ROOM = 6,
-    M_SEND_MESSAGE = 7,
+#define MQIPC_TYPE(type, value, layout, name) type = value,
+    MQIPC_REPLIES(MQIPC_TYPE)
+    MQIPC_REQUESTS(MQIPC_TYPE)
+#undef MQIPC_TYPE
     M_RECIEVE_MESSAGE = 8,
+    M_GATEWAY_DELIVER = 9,  // between server shards over a private channel, message for socket client
+    M_TYPES = 10,
+};
+
+// Bytes after mtype, the size msgsnd and msgrcv expect
+#define MQIPC_PAYLOAD(layout) (sizeof(layout) - sizeof(long))
+
+// Payload size of every catalogue message by type, 0 for other types
+static const size_t mqipcPayloads[M_TYPES] = {
+#define MQIPC_SIZE(type, value, layout, name) [type] = MQIPC_PAYLOAD(layout),
+    MQIPC_REPLIES(MQIPC_SIZE)
+    MQIPC_REQUESTS(MQIPC_SIZE)
+#undef MQIPC_SIZE
 };
 
+#define MQIPC_CHECK(type, value, layout, name)                                                      \
+    _Static_assert(offsetof(layout, mtype) == 0, #layout " must start with mtype");                 \
+    _Static_assert(MQIPC_PAYLOAD(layout) <= MQIPC_MAX_PAYLOAD, #layout " does not fit in a queue");
+#define MQIPC_CHECK_REQUEST(type, value, layout, name) \
+    _Static_assert(offsetof(layout, cmsgid) == sizeof(long), #layout " must start with client cmsgid");
+MQIPC_REPLIES(MQIPC_CHECK)
+MQIPC_REQUESTS(MQIPC_CHECK)
+MQIPC_REQUESTS(MQIPC_CHECK_REQUEST)
+#undef MQIPC_CHECK
+#undef MQIPC_CHECK_REQUEST
+_Static_assert(MQIPC_PAYLOAD(msg_batch) <= MQIPC_MAX_PAYLOAD, "msg_batch does not fit in a queue");
+_Static_assert(offsetof(msg_batch, cmsgid) == offsetof(msg_send_message, cmsgid), "batch frame marker must overlay message cmsgid");
+
+// Checks if type is a catalogue request
+static inline int mqipcRequest(long type) {
+    switch (type) {
+#define MQIPC_CASE(type, value, layout, name) case type:
+        MQIPC_REQUESTS(MQIPC_CASE)
+#undef MQIPC_CASE
+        return 1;
+    }
+    return 0;
+}
+
+// mqipcSend<name>(msgid, msg, flags) sets mtype and sends exact payload,
+// mqipcReceive<name>(msgid, msg, flags) receives message of that type.
+#define MQIPC_IO(type, value, layout, name)                                        \
+    static inline int mqipcSend##name(int msgid, layout *msg, int flags) {         \
+        msg->mtype = type;                                                         \
+        return msgsnd(msgid, msg, MQIPC_PAYLOAD(layout), flags);                   \
+    }                                                                              \
+    static inline ssize_t mqipcReceive##name(int msgid, layout *msg, int flags) {  \
+        return msgrcv(msgid, msg, MQIPC_PAYLOAD(layout), type, flags);             \
+    }
+MQIPC_REPLIES(MQIPC_IO)
+MQIPC_REQUESTS(MQIPC_IO)
+#undef MQIPC_IO
+
 #endif  // !MQIPC_H
\ No newline at end of file
@@ -0,0 +1,368 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "inf155851_154978_mqipc.h"
+
+#define REPLAY_CLIENTS 4096  // clients of the trace at most, power of 2
+#define REPLAY_PENDING 256   // unanswered requests tracked per client
+#define DRAIN_INTERVAL 64    // requests sent between draining every client queue
+#define SETTLE_TIME 1000000  // microseconds without replies that end the replay
+
+/// @brief Request read from trace file.
+typedef struct replay_record {
+    long long time;  // time request was taken by captured server (us)
+    int shard;       // shard that handled request
+    size_t index;    // position of request in its trace file
+    int length;      // request bytes including mtype
+    char *data;      // request
+} replay_record;
+
+/// @brief Client of the trace, replayed through its own queue.
+typedef struct replay_client {
+    int used;                         // slot taken
+    int original;                     // cmsgid in trace
+    int cmsgid;                       // queue created for replay
+    long long sent[REPLAY_PENDING];   // send times of unanswered requests (us)
+    unsigned int head;                // oldest unanswered request
+    unsigned int tail;                // next free entry
+} replay_client;
+
+/// @brief Latency samples (us).
+typedef struct latency {
+    long long *samples;
+    size_t count;
+    size_t capacity;
+} latency;
+
+replay_record *records = NULL;
+size_t recordCount = 0;
+size_t recordCapacity = 0;
+replay_client clients[REPLAY_CLIENTS];
+int clientCount = 0;
+mqipc_routing *routing = NULL;  // server routing table, NULL when not attached
+int server = -1;                // queue of shard 0
+latency responseLatency = {0};  // request sent to response received
+latency deliveryLatency = {0};  // message sent to delivered to subscriber
+unsigned long sentByType[M_TYPES];
+unsigned long responses = 0;
+unsigned long failed = 0;
+unsigned long throttled = 0;
+unsigned long sendWaits = 0;  // sends retried on full server queue
+
+void printError(char *msg) {
+    fprintf(stderr, "%s\nError: %s\n", msg, strerror(errno));
+}
+
+/// @brief Monotonic clock in microseconds, same clock as server timestamps.
+long long nowUsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void latencyAdd(latency *l, long long sample) {
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 1024;
+        l->samples = realloc(l->samples, l->capacity * sizeof(long long));
+        if (!l->samples) {
+            printError("Failed to allocate memory.");
+            exit(1);
+        }
+    }
+    l->samples[l->count++] = sample;
+}
+
+int compareSamples(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Prints mean, median, 99th percentile and maximum of samples.
+void latencyPrint(char *name, latency *l) {
+    if (!l->count) {
+        printf("%s latency: no samples\n", name);
+        return;
+    }
+    qsort(l->samples, l->count, sizeof(long long), compareSamples);
+    long long total = 0;
+    for (size_t i = 0; i < l->count; i++) {
+        total += l->samples[i];
+    }
+    printf("%s latency (us): mean %.1f, p50 %lld, p99 %lld, max %lld, %zu samples\n", name, (double)total / l->count,
+           l->samples[l->count / 2], l->samples[l->count * 99 / 100], l->samples[l->count - 1], l->count);
+}
+
+/// @brief Reads requests of one trace file.
+/// @param path Trace file.
+void traceLoad(char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printError("Failed to open trace file.");
+        exit(1);
+    }
+    mqipc_trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != MQIPC_TRACE_MAGIC || header.version != MQIPC_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace file.\n", path);
+        exit(1);
+    }
+    mqipc_trace_record record;
+    size_t index = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.length < sizeof(long) || record.length > sizeof(long) + MQIPC_MAX_PAYLOAD) {
+            fprintf(stderr, "%s is damaged.\n", path);
+            exit(1);
+        }
+        char *data = malloc(record.length);
+        if (!data || fread(data, record.length, 1, file) != 1) {
+            fprintf(stderr, "%s ends in a partial record.\n", path);
+            free(data);
+            break;
+        }
+        long type = *(long *)data;
+        if (!mqipcRequest(type) || record.length != sizeof(long) + mqipcPayloads[type]) {
+            fprintf(stderr, "%s is damaged.\n", path);
+            exit(1);
+        }
+        if (recordCount == recordCapacity) {
+            recordCapacity = recordCapacity ? recordCapacity * 2 : 1024;
+            records = realloc(records, recordCapacity * sizeof(replay_record));
+            if (!records) {
+                printError("Failed to allocate memory.");
+                exit(1);
+            }
+        }
+        replay_record *rec = &records[recordCount++];
+        rec->time = record.time;
+        rec->shard = header.shard;
+        rec->index = index++;
+        rec->length = record.length;
+        rec->data = data;
+    }
+    fclose(file);
+}
+
+int compareRecords(const void *a, const void *b) {
+    const replay_record *x = a, *y = b;
+    if (x->time != y->time) {
+        return (x->time > y->time) - (x->time < y->time);
+    }
+    // requests taken in the same microsecond keep their order within a shard, qsort is not stable
+    if (x->shard != y->shard) {
+        return (x->shard > y->shard) - (x->shard < y->shard);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/// @brief Finds replay client of trace cmsgid, creating its queue on first use.
+replay_client *clientFind(int original) {
+    unsigned int i = (unsigned int)original * 2654435761u % REPLAY_CLIENTS;
+    while (clients[i].used && clients[i].original != original) {
+        i = (i + 1) % REPLAY_CLIENTS;
+    }
+    replay_client *client = &clients[i];
+    if (!client->used) {
+        if (clientCount == REPLAY_CLIENTS - 1) {
+            fprintf(stderr, "Trace has more than %d clients.\n", REPLAY_CLIENTS - 1);
+            exit(1);
+        }
+        client->cmsgid = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
+        if (client->cmsgid == -1) {
+            printError("Failed to create message queue.");
+            exit(1);
+        }
+        client->used = 1;
+        client->original = original;
+        clientCount++;
+    }
+    return client;
+}
+
+/// @brief Takes delivered messages and responses waiting in client queue.
+/// @return Messages taken.
+int clientDrain(replay_client *client) {
+    union {
+        msg_response response;
+        msg_send_message msg;
+        msg_batch batch;
+    } frame;
+    int taken = 0;
+    ssize_t size;
+    while ((size = msgrcv(client->cmsgid, &frame, sizeof(frame) - sizeof(long), 0, MSG_NOERROR | IPC_NOWAIT)) != -1) {
+        long long now = nowUsec();
+        taken++;
+        if (frame.msg.cmsgid == MQIPC_BATCH_FRAME) {
+            char *pos = frame.batch.data;
+            for (int i = 0; i < frame.batch.count; i++) {
+                msg_batch_entry entry;
+                memcpy(&entry, pos, sizeof(entry));
+                pos += sizeof(entry) + entry.author_length + entry.room_length + entry.message_length;
+                latencyAdd(&deliveryLatency, now - entry.stamps[MQIPC_PUBLISHED]);
+            }
+        } else if ((size_t)size == MQIPC_PAYLOAD(msg_response)) {
+            // delivered messages of priority 1 share mtype with responses, not their size
+            if (frame.response.status == M_MORE) {
+                continue;
+            }
+            responses++;
+            failed += frame.response.status == M_FAIL;
+            throttled += frame.response.status == M_THROTTLED;
+            if (client->head != client->tail) {
+                latencyAdd(&responseLatency, now - client->sent[client->head++ % REPLAY_PENDING]);
+            }
+        } else {
+            latencyAdd(&deliveryLatency, now - frame.msg.stamps[MQIPC_PUBLISHED]);
+        }
+    }
+    return taken;
+}
+
+/// @brief Drains every client queue.
+/// @return Messages taken.
+int clientDrainAll() {
+    int taken = 0;
+    for (int i = 0; i < REPLAY_CLIENTS; i++) {
+        if (clients[i].used) {
+            taken += clientDrain(&clients[i]);
+        }
+    }
+    return taken;
+}
+
+/// @brief Sends recorded request as its client, to the shard that handled it.
+/// @return Client of request.
+replay_client *replaySend(replay_record *rec) {
+    long type = *(long *)rec->data;
+    // every request starts with client cmsgid after mtype
+    int *cmsgid = (int *)(rec->data + sizeof(long));
+    replay_client *client = clientFind(*cmsgid);
+    *cmsgid = client->cmsgid;
+    if (type == M_LOGIN) {
+        ((msg_login *)rec->data)->pid = getpid();
+    }
+    int msgid = routing ? routing->queues[rec->shard % routing->shards] : server;
+    long long now = nowUsec();
+    if (type == M_SEND_MESSAGE) {
+        msg_send_message *msg = (msg_send_message *)rec->data;
+        memset(msg->stamps, 0, sizeof(msg->stamps));
+        msg->stamps[MQIPC_PUBLISHED] = now;
+    }
+    // keep taking replies while server queue is full
+    while (msgsnd(msgid, rec->data, rec->length - sizeof(long), IPC_NOWAIT) == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            printError("Failed to send request.");
+            exit(1);
+        }
+        sendWaits++;
+        if (!clientDrainAll()) {
+            usleep(100);
+        }
+    }
+    sentByType[type]++;
+    // logout has no response, list rooms sent to each shard is traced by each shard
+    if (type != M_LOGOUT && client->tail - client->head < REPLAY_PENDING) {
+        client->sent[client->tail++ % REPLAY_PENDING] = now;
+    }
+    return client;
+}
+
+int main(int argc, char *const argv[]) {
+    double speed = 1;  // replay speed, 0 sends as fast as possible
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's':
+                speed = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s speed] trace_file...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind == argc || speed < 0) {
+        fprintf(stderr, "Usage: %s [-s speed] trace_file...\n  -s 1 replays in original time (default), -s 2 twice as fast, -s 0 as fast as possible\n", argv[0]);
+        return 1;
+    }
+    // merge shard traces into one timeline
+    for (int i = optind; i < argc; i++) {
+        traceLoad(argv[i]);
+    }
+    if (!recordCount) {
+        fprintf(stderr, "Trace has no requests.\n");
+        return 1;
+    }
+    qsort(records, recordCount, sizeof(replay_record), compareRecords);
+    // connect to server
+    server = msgget(MQIPC_SERVER, 0666);
+    if (server == -1) {
+        printError("Server is not running.");
+        return 1;
+    }
+    int shared = shmget(MQIPC_SERVER, 0, 0);
+    if (shared != -1) {
+        routing = shmat(shared, NULL, SHM_RDONLY);
+        if (routing == (void *)-1) {
+            routing = NULL;
+        }
+    }
+    double traced = (records[recordCount - 1].time - records[0].time) / 1e6;
+    printf("Replaying %zu requests over %.2f s of trace at ", recordCount, traced);
+    if (speed) {
+        printf("%gx speed\n", speed);
+    } else {
+        printf("full speed\n");
+    }
+    long long start = nowUsec();
+    for (size_t i = 0; i < recordCount; i++) {
+        replay_record *rec = &records[i];
+        // wait for time of request, taking replies meanwhile
+        if (speed) {
+            long long due = start + (long long)((rec->time - records[0].time) / speed);
+            long long now;
+            while ((now = nowUsec()) < due) {
+                if (!clientDrainAll()) {
+                    usleep(due - now < 1000 ? due - now : 1000);
+                }
+            }
+        }
+        // take the response of sending client early
+        clientDrain(replaySend(rec));
+        if (i % DRAIN_INTERVAL == DRAIN_INTERVAL - 1) {
+            clientDrainAll();
+        }
+    }
+    long long sent = nowUsec();
+    // wait until replies stop
+    long long quiet = sent;
+    while (nowUsec() - quiet < SETTLE_TIME) {
+        if (clientDrainAll()) {
+            quiet = nowUsec();
+        } else {
+            usleep(1000);
+        }
+    }
+    // report
+    double sending = (sent - start) / 1e6;
+    printf("Sent %zu requests in %.2f s, %.0f requests per second\n", recordCount, sending, sending > 0 ? recordCount / sending : 0);
+    printf("  %lu login, %lu logout, %lu create room, %lu list rooms, %lu join room, %lu send message\n", sentByType[M_LOGIN],
+           sentByType[M_LOGOUT], sentByType[M_CREATE_ROOM], sentByType[M_LIST_ROOMS], sentByType[M_JOIN_ROOM], sentByType[M_SEND_MESSAGE]);
+    printf("Clients: %d, %lu sends waited for full server queue\n", clientCount, sendWaits);
+    printf("Responses: %lu, %lu failed, %lu throttled\n", responses, failed, throttled);
+    double delivering = (quiet - start) / 1e6;
+    printf("Deliveries: %zu messages, %.0f messages per second\n", deliveryLatency.count, delivering > 0 ? deliveryLatency.count / delivering : 0);
+    latencyPrint("Response", &responseLatency);
+    latencyPrint("Delivery", &deliveryLatency);
+    // remove client queues
+    for (int i = 0; i < REPLAY_CLIENTS; i++) {
+        if (clients[i].used) {
+            msgctl(clients[i].cmsgid, IPC_RMID, NULL);
+        }
+    }
+    return 0;
+}
@@ -1,12 +1,33 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/resource.h>
+#include <sys/shm.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "inf155851_154978_mqipc.h"
@@ -14,16 +35,309 @@
 // Message Queue
 #define RESPONSE_QUEUE_SIZE 16
 // Database
-#define DATABASE_DIR "database"
-#define USERS_DB "database/users.db"
-#define ROOMS_DB "database/rooms.db"
-#define KEYS_DB "database/keys.db"
-#define TEMP_DB "database/temp.db"
+#define DATABASE_DIR "database"  // shard 0 tables, other shards use DATABASE_DIR/shard<id>
+#define LOCK_DB "database/lock"
+#define USERS_DB "users.db"
+#define ROOMS_DB "rooms.db"
+#define KEYS_DB "keys.db"
+#define DB_MAX_USERS 1024   // users table capacity
+#define DB_MAX_ROOMS 1024   // rooms table capacity
+#define DB_MAX_KEYS 8192    // subscriptions table capacity
+#define COMMIT_DELAY 2000   // microseconds changes may wait for group commit
+#define COMMIT_MAX 64       // requests sharing one commit at most
+// Allocator
+#define POOL_CLASSES 16     // size classes
+#define POOL_SLAB_SIZE 64   // objects per slab
+#define ARENA_BLOCK 4096    // arena block size
+#define ALLOC_ALIGN 16      // alignment of pooled and arena objects
+// Delivery
+#define BATCH_DELAY 1000     // default microseconds a message may wait for a batch frame
+#define OVERFLOW_RETRY 1000  // microseconds between retries to full subscriber queues
+#define SUBSCRIBER_BUFFER (1 << 20)  // default bytes buffered per subscriber
+// Rate limiting
+#define BUCKET_TABLE 256  // token bucket hash table size
+// Presence
+#define LIVENESS_INTERVAL 5  // seconds between client liveness checks
+#define SESSION_TABLE 2048   // shared session table slots, power of 2 above DB_MAX_USERS
+// Event loop
+#define REQUEST_RING 256  // requests received ahead of the event loop
+// Gateway
+#define GATEWAY_CONNECTIONS 256  // socket clients at most
+#define GATEWAY_BUFFER 65536     // initial bytes buffered per connection and direction
+#define GATEWAY_FLUSH 16384      // buffered output written before the event loop goes idle
+#define GATEWAY_RECEIVE 64       // requests handled between taking deliveries of other shards
+#define GATEWAY_PASS_RETRIES 100  // tries to pass a message to shard 0, 100 us apart, before giving up
 
 void printError(char *msg) {
     fprintf(stderr, "%s\nError: %s\n", msg, strerror(errno));
 }
 
+/// @brief Server settings, set from command line.
+typedef struct server_config {
+    int batchBytes;      // batch frame size limit, 0 disables batching
+    int batchDelay;      // microseconds a message may wait for a batch frame
+    double authorRate;   // messages per second per author, 0 disables the limit
+    double authorBurst;  // messages an author may send at once
+    double roomRate;     // messages per second per room, 0 disables the limit
+    double roomBurst;    // messages a room may receive at once
+    int shards;          // server processes sharing rooms
+    char *gatewayPath;   // gateway Unix socket, NULL disables it
+    int gatewayPort;     // gateway loopback TCP port, 0 disables it
+    int spin;            // microseconds to poll for requests after the last one, 0 blocks at once
+    int cpu;             // CPU of shard 0 event loop, shard i uses the i-th next one, -1 leaves it unpinned
+    char *tracePath;     // capture file of handled requests, shard i > 0 appends .i, NULL disables capture
+    int maxUsers;        // registered users at most
+    int maxRooms;        // rooms of all shards at most
+    int maxSubscribers;  // subscribers of a room at most
+    int maxBuffered;     // bytes buffered per subscriber at most, messages beyond are dropped
+} server_config;
+
+server_config config = {0, BATCH_DELAY, 0, 0, 0, 0, 1, NULL, 0, 0, -1, NULL, DB_MAX_USERS, DB_MAX_ROOMS, DB_MAX_KEYS, SUBSCRIBER_BUFFER};
+long long serverStart = 0;  // start of this shard (us)
+
+/// @brief Monotonic clock in microseconds.
+long long nowUsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+typedef struct db_user {
+    int id;
+    char name[32];
+    int cmsgid;  // 0 when logged out
+} db_user;
+
+typedef struct db_room {
+    int id;
+    char name[32];
+    unsigned int sequence;  // number of last published message, not stored
+    int subscribers;        // subscriptions of room, not stored
+} db_room;
+
+typedef struct db_key {
+    int room;          // room id
+    char user[32];     // username
+    int subscribtion;  // -1 infinite, >0 number of messages
+} db_key;
+
+/// @brief Tables kept in memory and written back to database files on commit.
+typedef struct database {
+    int userCount;
+    int roomCount;
+    int keyCount;
+    db_user users[DB_MAX_USERS];
+    db_room rooms[DB_MAX_ROOMS];
+    db_key keys[DB_MAX_KEYS];
+} database;
+
+enum db_table {
+    DB_USERS = 1,
+    DB_ROOMS = 2,
+    DB_KEYS = 4,
+};
+
+database dbTables;
+database *db = &dbTables;          // tables of this shard
+char dbDir[64] = DATABASE_DIR;     // directory of this shard tables
+int dbDirty = 0;                   // tables changed since last commit
+int *dbRoomsTotal = NULL;          // rooms of all shards, in shared memory
+char (*dbRoomNames)[32] = NULL;    // room names of this shard, in shared memory
+int *dbRoomsListed = NULL;         // names published in dbRoomNames
+int dbLock = -1;                   // database lock file
+long long commitSince = 0;         // time of first uncommitted change (us)
+unsigned long commits = 0;         // group commits
+unsigned long commitRequests = 0;  // requests made durable by commits
+
+void dbChanged(int table) {
+    if (!dbDirty) {
+        commitSince = nowUsec();
+    }
+    dbDirty |= table;
+}
+
+uint32_t crc32(uint32_t crc, const char *data, size_t length) {
+    crc = ~crc;
+    while (length--) {
+        crc ^= (unsigned char)*data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/// @brief Reads table file and verifies its checksum trailer.
+/// @param path Table file.
+/// @param data Read file contents, NUL terminated, caller frees.
+/// @param length Length of table records, trailer excluded.
+/// @return 1 if checksum is valid, 0 if file has no trailer, -1 if checksum is wrong, -2 if file can not be read.
+int dbRead(char *path, char **data, size_t *length) {
+    *data = NULL;
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -2;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    *data = malloc(size + 1);
+    if (!*data) {
+        printError("Failed to allocate database buffer.");
+        exit(1);
+    }
+    size = fread(*data, 1, size, file);
+    (*data)[size] = '\0';
+    fclose(file);
+    // trailer is the last line: "# <crc32> <records>"
+    *length = size;
+    char *trailer = size ? *data + size - 1 : *data;
+    while (trailer > *data && trailer[-1] != '\n') {
+        trailer--;
+    }
+    if (trailer[0] != '#') {
+        return 0;
+    }
+    *length = trailer - *data;
+    unsigned int crc;
+    if (sscanf(trailer, "# %x", &crc) != 1 || crc != crc32(0, *data, *length)) {
+        return -1;
+    }
+    return 1;
+}
+
+/// @brief Finds room by id.
+/// @return Room, NULL if room does not exist.
+db_room *dbRoomById(int id) {
+    for (int i = 0; i < db->roomCount; i++) {
+        if (db->rooms[i].id == id) {
+            return &db->rooms[i];
+        }
+    }
+    return NULL;
+}
+
+/// @brief Stops server whose stored table does not fit in memory, rewriting it would drop records.
+/// @param name Table file in shard directory.
+/// @param capacity Table capacity.
+void dbFull(char *name, int capacity) {
+    fprintf(stderr, "Database %s/%s holds more than %d records, raise its capacity to load it.\n", dbDir, name, capacity);
+    exit(1);
+}
+
+int dbParseUser(char *line) {
+    db_user user;
+    if (sscanf(line, "%d %31s %d", &user.id, user.name, &user.cmsgid) != 3) {
+        return -1;
+    }
+    // socket clients have negative cmsgids, their connections did not survive restart
+    if (user.cmsgid < 0) {
+        user.cmsgid = 0;
+    }
+    if (db->userCount == DB_MAX_USERS) {
+        dbFull(USERS_DB, DB_MAX_USERS);
+    }
+    db->users[db->userCount++] = user;
+    return 0;
+}
+
+int dbParseRoom(char *line) {
+    db_room room = {0};
+    if (sscanf(line, "%d %31s", &room.id, room.name) != 2) {
+        return -1;
+    }
+    if (db->roomCount == DB_MAX_ROOMS) {
+        dbFull(ROOMS_DB, DB_MAX_ROOMS);
+    }
+    db->rooms[db->roomCount++] = room;
+    return 0;
+}
+
+int dbParseKey(char *line) {
+    db_key key;
+    if (sscanf(line, "%d %31s %d", &key.room, key.user, &key.subscribtion) != 3) {
+        return -1;
+    }
+    if (db->keyCount == DB_MAX_KEYS) {
+        dbFull(KEYS_DB, DB_MAX_KEYS);
+    }
+    // rooms table is loaded first
+    db_room *room = dbRoomById(key.room);
+    if (room) {
+        room->subscribers++;
+    }
+    db->keys[db->keyCount++] = key;
+    return 0;
+}
+
+/// @brief Parses table records line by line.
+/// @param parsed Bytes parsed before the first malformed or unfinished line.
+/// @return Number of records parsed.
+int dbParse(char *data, size_t length, int (*parse)(char *), size_t *parsed) {
+    int records = 0;
+    char *start = data, *end = data + length;
+    while (data < end) {
+        char *newline = memchr(data, '\n', end - data);
+        if (!newline) {
+            break;  // unfinished append
+        }
+        *newline = '\0';
+        if (parse(data) == -1) {
+            break;
+        }
+        records++;
+        data = newline + 1;
+    }
+    *parsed = data - start;
+    return records;
+}
+
+/// @brief Loads table, recovering it after a crash or corruption.
+/// @param name Table file in shard directory.
+/// @param table Table flag.
+/// @param parse Record parser.
+/// @param count Record counter of the table.
+void dbLoad(char *name, int table, int (*parse)(char *), int *count) {
+    char path[96], temp[100];
+    snprintf(path, sizeof(path), "%s/%s", dbDir, name);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    char *data;
+    size_t length = 0, parsed = 0;
+    int status = dbRead(path, &data, &length);
+    if (status == -2 && errno != ENOENT) {
+        printError("Failed to open database.");
+        exit(1);
+    }
+    if (status < 0) {
+        // table missing or corrupted, a complete update may be left behind by a crash
+        char *update;
+        size_t update_length;
+        if (dbRead(temp, &update, &update_length) == 1) {
+            free(data);
+            data = update;
+            length = update_length;
+            printf("Database %s: recovered from unfinished update.\n", path);
+            status = 2;
+        } else {
+            free(update);
+        }
+    }
+    *count = 0;
+    if (data) {
+        int records = dbParse(data, length, parse, &parsed);
+        if (status == -1 || parsed < length) {
+            printf("Database %s: damaged, recovered %d records.\n", path, records);
+        }
+    }
+    free(data);
+    if (status == 1 && parsed == length) {
+        remove(temp);  // update that never started replacing the table
+        return;
+    }
+    // rewrite new, recovered and older tables without checksum, update left behind is replaced on commit
+    dbChanged(table);
+}
+
 void dbInit() {
     // check if database directory exists
     struct stat st = {0};
@@ -31,462 +345,2541 @@ void dbInit() {
         // create database directory
         mkdir(DATABASE_DIR, 0755);
     }
-    // create users database
-    FILE *users = fopen(USERS_DB, "a");
-    if (!users) {
-        printError("Failed to create users database.");
-        exit(1);
+    // only one server may use the database
+    dbLock = open(LOCK_DB, O_RDWR | O_CREAT, 0644);
+    if (dbLock == -1) {
+        printError("Failed to create database lock.");
+        exit(1);
+    }
+    if (flock(dbLock, LOCK_EX | LOCK_NB) == -1) {
+        printError("Database is used by another server.");
+        exit(1);
+    }
+}
+
+/// @brief Loads tables of a shard.
+/// @param dir Shard directory.
+/// @param users Shard keeps users table.
+void dbOpen(char *dir, int users) {
+    strcpy(dbDir, dir);
+    mkdir(dbDir, 0755);
+    if (users) {
+        dbLoad(USERS_DB, DB_USERS, dbParseUser, &db->userCount);
+    }
+    dbLoad(ROOMS_DB, DB_ROOMS, dbParseRoom, &db->roomCount);
+    dbLoad(KEYS_DB, DB_KEYS, dbParseKey, &db->keyCount);
+}
+
+/// @brief Appends record to table file being written.
+void dbPrint(FILE *file, uint32_t *crc, const char *format, ...) {
+    char line[128];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    *crc = crc32(*crc, line, length);
+    fputs(line, file);
+}
+
+/// @brief Replaces table file atomically: writes temporary file, syncs it and renames it over the table.
+void dbWrite(char *name, int table) {
+    char path[96], temp[100];
+    snprintf(path, sizeof(path), "%s/%s", dbDir, name);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *file = fopen(temp, "w");
+    if (!file) {
+        printError("Failed to open temp database.");
+        exit(1);
+    }
+    uint32_t crc = 0;
+    int records = 0;
+    switch (table) {
+        case DB_USERS:
+            for (records = 0; records < db->userCount; records++) {
+                db_user *user = &db->users[records];
+                dbPrint(file, &crc, "%d %s %d\n", user->id, user->name, user->cmsgid);
+            }
+            break;
+        case DB_ROOMS:
+            for (records = 0; records < db->roomCount; records++) {
+                db_room *room = &db->rooms[records];
+                dbPrint(file, &crc, "%d %s\n", room->id, room->name);
+            }
+            break;
+        case DB_KEYS:
+            for (records = 0; records < db->keyCount; records++) {
+                db_key *key = &db->keys[records];
+                dbPrint(file, &crc, "%d %s %d\n", key->room, key->user, key->subscribtion);
+            }
+            break;
+    }
+    fprintf(file, "# %08x %d\n", crc, records);
+    if (fflush(file) == EOF || fsync(fileno(file)) == -1) {
+        printError("Failed to write database.");
+        exit(1);
+    }
+    fclose(file);
+    if (rename(temp, path) == -1) {
+        printError("Failed to replace database.");
+        exit(1);
+    }
+}
+
+/// @brief Makes table changes durable, one sync for all requests handled since the last commit.
+/// @param requests Requests handled since the last commit.
+void dbCommit(int requests) {
+    if (!dbDirty) {
+        return;
+    }
+    if (dbDirty & DB_USERS) {
+        dbWrite(USERS_DB, DB_USERS);
+    }
+    if (dbDirty & DB_ROOMS) {
+        dbWrite(ROOMS_DB, DB_ROOMS);
+    }
+    if (dbDirty & DB_KEYS) {
+        dbWrite(KEYS_DB, DB_KEYS);
+    }
+    // make renames durable
+    int dir = open(dbDir, O_RDONLY | O_DIRECTORY);
+    if (dir == -1 || fsync(dir) == -1) {
+        printError("Failed to sync database directory.");
+        exit(1);
+    }
+    close(dir);
+    dbDirty = 0;
+    commits++;
+    commitRequests += requests;
+}
+
+/// @brief Finds user by name.
+/// @param username Username.
+/// @return Index of user in users table, -1 if user does not exist.
+int dbUserExists(char *username) {
+    for (int i = 0; i < db->userCount; i++) {
+        if (strcmp(db->users[i].name, username) == 0) {
+            return i;  // User exists
+        }
+    }
+    return -1;
+}
+
+int dbEditUser(char *username, int cmsgid) {
+    for (int i = 0; i < db->userCount; i++) {
+        if (strcmp(db->users[i].name, username) == 0) {
+            db->users[i].cmsgid = cmsgid;
+            dbChanged(DB_USERS);
+            return 0;  // User exists
+        }
+    }
+    return 1;  // User does not exist
+}
+
+/// @brief Adds user or logs in existing one.
+/// @return 0 on success, cmsgid of logged in user with the same name, -1 if user limit is reached.
+int dbAddUser(char *username, int cmsgid) {
+    int index = dbUserExists(username);
+    if (index >= 0) {
+        // logged in elsewhere, socket clients have negative cmsgids
+        if (db->users[index].cmsgid) {
+            return db->users[index].cmsgid;
+        }
+        return dbEditUser(username, cmsgid);
+    }
+    if (db->userCount >= config.maxUsers) {
+        return -1;
+    }
+    db_user *user = &db->users[db->userCount];
+    user->id = db->userCount ? db->users[db->userCount - 1].id + 1 : 1;
+    db->userCount++;
+    strcpy(user->name, username);
+    user->cmsgid = cmsgid;
+    dbChanged(DB_USERS);
+    return 0;
+}
+
+void dbRemoveUser(int cmsgid) {
+    for (int i = 0; i < db->userCount; i++) {
+        if (db->users[i].cmsgid == cmsgid) {
+            db->users[i].cmsgid = 0;
+            dbChanged(DB_USERS);
+        }
+    }
+}
+
+/// @brief Checks if room exists.
+/// @param room_name Room name.
+/// @return Room id if room exists, negative value of next id otherwise.
+int dbRoomExists(char *room_name) {
+    int id = 0;
+    for (int i = 0; i < db->roomCount; i++) {
+        if (strcmp(db->rooms[i].name, room_name) == 0) {
+            return db->rooms[i].id;  // Room exists
+        }
+        id = db->rooms[i].id;
+    }
+    return -(++id);
+}
+
+/// @brief Finds room by name.
+/// @return Room, NULL if room does not exist.
+db_room *dbRoomFind(char *room_name) {
+    for (int i = 0; i < db->roomCount; i++) {
+        if (strcmp(db->rooms[i].name, room_name) == 0) {
+            return &db->rooms[i];
+        }
+    }
+    return NULL;
+}
+
+/// @brief Adds room.
+/// @return 0 on success, id of existing room with the same name, -1 if room limit is reached.
+int dbAddRoom(char *room_name) {
+    int tmp = dbRoomExists(room_name);
+    if (tmp > 0) {
+        return tmp;
+    }
+    if (db->roomCount == DB_MAX_ROOMS) {
+        return -1;
+    }
+    // rooms of all shards count against the limit
+    if (__atomic_add_fetch(dbRoomsTotal, 1, __ATOMIC_RELAXED) > config.maxRooms) {
+        __atomic_sub_fetch(dbRoomsTotal, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    db_room *room = &db->rooms[db->roomCount++];
+    room->id = -tmp;
+    strcpy(room->name, room_name);
+    room->sequence = 0;
+    room->subscribers = 0;
+    dbChanged(DB_ROOMS);
+    // socket clients list rooms of every shard from shard 0
+    if (dbRoomNames) {
+        strcpy(dbRoomNames[db->roomCount - 1], room_name);
+        __atomic_store_n(dbRoomsListed, db->roomCount, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int dbEditRoom(int roomid, char *username, int sub) {
+    for (int i = 0; i < db->keyCount; i++) {
+        db_key *key = &db->keys[i];
+        if (key->room == roomid && strcmp(key->user, username) == 0) {
+            key->subscribtion = sub;
+            dbChanged(DB_KEYS);
+            return 0;  // User is in room
+        }
+    }
+    return 1;  // User is not in room
+}
+
+/// @brief Subscribes user to room.
+/// @param limit Subscribers room may have at most.
+/// @return 0 when joined, 1 if room does not exist, 2 if subscribtion was changed, -1 if subscriptions table is full,
+/// -2 if room has limit subscribers.
+int dbJoinRoom(char *room_name, char *username, int subscribtion, int limit) {
+    db_room *room = dbRoomFind(room_name);
+    if (!room) {
+        return 1;  // Room does not exist
+    }
+    // edit room if user is already in it
+    if (!dbEditRoom(room->id, username, subscribtion)) {
+        return 2;  // User is in room
+    }
+    if (db->keyCount == DB_MAX_KEYS) {
+        return -1;
+    }
+    if (room->subscribers >= limit) {
+        return -2;
+    }
+    room->subscribers++;
+    db_key *sub = &db->keys[db->keyCount++];
+    sub->room = room->id;
+    strcpy(sub->user, username);
+    sub->subscribtion = subscribtion;
+    dbChanged(DB_KEYS);
+    return 0;
+}
+
+/// @brief Removes room, its subscriptions stay.
+void dbRemoveRoom(int index) {
+    __atomic_sub_fetch(dbRoomsTotal, 1, __ATOMIC_RELAXED);
+    memmove(&db->rooms[index], &db->rooms[index + 1], (db->roomCount - index - 1) * sizeof(db_room));
+    db->roomCount--;
+    dbChanged(DB_ROOMS);
+}
+
+/// @brief Removes subscription, keeping table order.
+void dbRemoveKey(int index) {
+    db_room *room = dbRoomById(db->keys[index].room);
+    if (room) {
+        room->subscribers--;
+    }
+    memmove(&db->keys[index], &db->keys[index + 1], (db->keyCount - index - 1) * sizeof(db_key));
+    db->keyCount--;
+    dbChanged(DB_KEYS);
+}
+
+/// @brief Free object inside a slab.
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object;
+
+/// @brief Slab pool serving objects of one size class.
+typedef struct pool {
+    size_t size;          // object size
+    pool_object *free;    // free objects
+    unsigned long allocs;  // objects handed out
+    unsigned long frees;   // objects returned
+    unsigned long slabs;   // slabs allocated
+    unsigned long used;    // objects in use
+    unsigned long peak;    // most objects in use at once
+} pool;
+
+/// @brief Block of a per-request arena.
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;  // usable bytes
+    size_t used;  // bytes handed out
+    char data[];
+} arena_block;
+
+/// @brief Bump allocator released in one step when a request is handled.
+typedef struct arena {
+    arena_block *first;    // blocks, kept across requests
+    arena_block *current;  // block being filled
+    size_t used;           // bytes used by current request
+    size_t peak;           // most bytes used by one request
+    unsigned long blocks;  // blocks allocated
+    unsigned long allocs;  // objects handed out
+    unsigned long resets;  // requests released
+} arena;
+
+pool pools[POOL_CLASSES];  // size classes, ascending
+int poolCount = 0;
+arena requestArena = {0};  // objects of the request being handled
+
+size_t allocAlign(size_t size) {
+    return (size + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1);
+}
+
+/// @brief Registers size class for objects of given size.
+/// @param size Object size.
+void poolRegister(size_t size) {
+    size = allocAlign(size);
+    int i = 0;
+    while (i < poolCount && pools[i].size < size) {
+        i++;
+    }
+    if (i < poolCount && pools[i].size == size) {
+        return;  // class already exists
+    }
+    if (poolCount == POOL_CLASSES) {
+        fprintf(stderr, "Too many pool size classes.\n");
+        exit(1);
+    }
+    memmove(&pools[i + 1], &pools[i], (poolCount - i) * sizeof(pool));
+    memset(&pools[i], 0, sizeof(pool));
+    pools[i].size = size;
+    poolCount++;
+}
+
+pool *poolFind(size_t size) {
+    for (int i = 0; i < poolCount; i++) {
+        if (pools[i].size >= size) {
+            return &pools[i];
+        }
+    }
+    fprintf(stderr, "No pool for objects of %zu bytes.\n", size);
+    exit(1);
+}
+
+void *poolAlloc(size_t size) {
+    pool *p = poolFind(size);
+    // refill pool with a new slab
+    if (!p->free) {
+        char *slab = malloc(POOL_SLAB_SIZE * p->size);
+        if (!slab) {
+            printError("Failed to allocate slab.");
+            exit(1);
+        }
+        for (int i = POOL_SLAB_SIZE - 1; i >= 0; i--) {
+            pool_object *obj = (pool_object *)(slab + i * p->size);
+            obj->next = p->free;
+            p->free = obj;
+        }
+        p->slabs++;
+    }
+    pool_object *obj = p->free;
+    p->free = obj->next;
+    p->allocs++;
+    if (++p->used > p->peak) {
+        p->peak = p->used;
+    }
+    return obj;
+}
+
+void poolFree(void *ptr, size_t size) {
+    pool *p = poolFind(size);
+    pool_object *obj = ptr;
+    obj->next = p->free;
+    p->free = obj;
+    p->frees++;
+    p->used--;
+}
+
+void *arenaAlloc(arena *a, size_t size) {
+    size = allocAlign(size);
+    // blocks after the current one are unused
+    arena_block *block = a->current;
+    while (block && block->used + size > block->size) {
+        block = block->next;
+    }
+    if (!block) {
+        size_t bytes = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        block = malloc(sizeof(arena_block) + bytes);
+        if (!block) {
+            printError("Failed to allocate arena block.");
+            exit(1);
+        }
+        block->size = bytes;
+        block->used = 0;
+        block->next = NULL;
+        // append block to the arena
+        arena_block **link = &a->first;
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = block;
+        a->blocks++;
+    }
+    a->current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    a->used += size;
+    a->allocs++;
+    return ptr;
+}
+
+/// @brief Releases everything allocated from arena, keeping its blocks for the next request.
+void arenaReset(arena *a) {
+    for (arena_block *block = a->first; block; block = block->next) {
+        block->used = 0;
+    }
+    a->current = a->first;
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    a->used = 0;
+    a->resets++;
+}
+
+/// @brief Published message, stored once and shared by every delivery of it.
+typedef struct msg_buffer {
+    int refs;              // deliveries still holding the buffer
+    msg_send_message msg;  // message as delivered to subscribers
+} msg_buffer;
+
+/// @brief Message waiting for a subscriber queue to drain or for a batch frame.
+typedef struct overflow_node {
+    msg_buffer *buf;
+    int size;            // packed size in batch frame
+    long long queued;    // time message was queued (us)
+    struct overflow_node *next;
+} overflow_node;
+
+/// @brief Messages waiting for a subscriber, in send order.
+typedef struct overflow_queue {
+    int cmsgid;  // subscriber cmsgid
+    int batch;   // subscriber accepts batch frames
+    int bytes;   // packed size of waiting messages
+    overflow_node *head;
+    overflow_node *tail;
+    struct overflow_queue *next;
+} overflow_queue;
+
+enum session_state {
+    SESSION_EMPTY = 0,
+    SESSION_LIVE = 1,
+    SESSION_REMOVED = 2,
+};
+
+/// @brief Logged in client, in shared memory so every shard can deliver to it.
+/// Written by shard 0 only, readers take a consistent copy with sessionByName().
+typedef struct session {
+    unsigned int seq;  // odd while slot is being written
+    int state;         // session_state
+    char username[32];
+    int cmsgid;  // client cmsgid
+    int pid;     // client process id, 0 when unknown
+    int batch;   // client accepts batch frames
+    int dead;    // client queue is gone, reap on next check
+} session;
+
+/// @brief Server state shared by all shards.
+typedef struct shared_state {
+    mqipc_routing routing;           // read by clients, must stay first
+    int lost;                        // sessions marked dead by deliveries
+    unsigned long sessionsLive;      // logged in clients
+    unsigned long sessionsReaped;    // dead clients cleaned up
+    int rooms;                       // rooms of all shards
+    session sessions[SESSION_TABLE];  // open addressing by username hash
+    int roomsListed[MQIPC_MAX_SHARDS];                   // names published by each shard
+    char roomNames[MQIPC_MAX_SHARDS][DB_MAX_ROOMS][32];  // room names of each shard, listed to socket clients
+} shared_state;
+
+/// @brief Token bucket limiting publish rate of an author or a room.
+typedef struct token_bucket {
+    char name[32];       // author or room name
+    double tokens;       // messages that may be published now
+    long long updated;   // time of last refill (us)
+    struct token_bucket *next;
+} token_bucket;
+
+/// @brief Response held back until the changes it reports are committed.
+typedef struct response_node {
+    int cmsgid;  // client cmsgid
+    msg_response response;
+    struct response_node *next;
+} response_node;
+
+overflow_queue *overflows = NULL;  // subscribers with pending messages
+shared_state *shared = NULL;       // state shared by all shards
+int sharedId = -1;                 // shared memory id
+int shardId = 0;                   // shard of this process
+pid_t shardPids[MQIPC_MAX_SHARDS];  // shard processes, in shard 0
+response_node *responses = NULL;   // responses waiting for commit
+response_node **responsesTail = &responses;
+int responsesDeferred = 0;         // responses waiting for commit
+unsigned long deliveries = 0;      // messages delivered to subscribers
+unsigned long deliverySends = 0;   // msgsnd calls for deliveries, retries included
+unsigned long batchFrames = 0;     // batch frames sent
+long bufferedBytes = 0;            // bytes waiting in overflow queues of all subscribers
+long bufferedPeak = 0;             // most bytes waiting at once
+unsigned long bufferDropped = 0;   // deliveries dropped by subscriber buffer limit
+unsigned long limitRejected = 0;   // requests rejected by a limit
+msg_batch batchFrame;              // frame being packed
+
+void allocInit() {
+    // long-lived server objects, request messages live in the request arena
+    poolRegister(sizeof(msg_buffer));
+    poolRegister(sizeof(overflow_node));
+    poolRegister(sizeof(overflow_queue));
+    poolRegister(sizeof(token_bucket));
+    poolRegister(sizeof(response_node));
+}
+
+msg_buffer *bufferAlloc() {
+    msg_buffer *buf = poolAlloc(sizeof(msg_buffer));
+    buf->refs = 1;
+    return buf;
+}
+
+void bufferRetain(msg_buffer *buf) {
+    buf->refs++;
+}
+
+void bufferRelease(msg_buffer *buf) {
+    // return buffer to pool after its last delivery
+    if (--buf->refs == 0) {
+        poolFree(buf, sizeof(msg_buffer));
+    }
+}
+
+/// @brief Appends message to subscriber overflow queue, creating the queue if needed.
+/// @param queue Subscriber overflow queue or NULL.
+/// @param cmsgid Subscriber cmsgid.
+/// @param batch Subscriber accepts batch frames.
+/// @param buf Message buffer, reference is taken over by the queue.
+void overflowPush(overflow_queue *queue, int cmsgid, int batch, msg_buffer *buf) {
+    int size = sizeof(msg_batch_entry) + strlen(buf->msg.author) + strlen(buf->msg.room_name) + strlen(buf->msg.message);
+    // subscriber that stopped reading loses newest messages, sequence numbers show the gap
+    if (queue && queue->bytes + size > config.maxBuffered) {
+        bufferDropped++;
+        bufferRelease(buf);
+        return;
+    }
+    if (!queue) {
+        queue = poolAlloc(sizeof(overflow_queue));
+        queue->cmsgid = cmsgid;
+        queue->batch = batch;
+        queue->bytes = 0;
+        queue->head = queue->tail = NULL;
+        queue->next = overflows;
+        overflows = queue;
+    }
+    overflow_node *node = poolAlloc(sizeof(overflow_node));
+    node->buf = buf;
+    node->size = size;
+    node->queued = batch ? nowUsec() : 0;
+    node->next = NULL;
+    if (queue->tail)
+        queue->tail->next = node;
+    else
+        queue->head = node;
+    queue->tail = node;
+    queue->bytes += node->size;
+    bufferedBytes += node->size;
+    if (bufferedBytes > bufferedPeak) {
+        bufferedPeak = bufferedBytes;
+    }
+}
+
+/// @brief Removes first waiting message.
+void overflowPop(overflow_queue *queue) {
+    overflow_node *node = queue->head;
+    queue->head = node->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    queue->bytes -= node->size;
+    bufferedBytes -= node->size;
+    bufferRelease(node->buf);
+    poolFree(node, sizeof(overflow_node));
+}
+
+overflow_queue *overflowFind(int cmsgid) {
+    for (overflow_queue *queue = overflows; queue; queue = queue->next) {
+        if (queue->cmsgid == cmsgid) {
+            return queue;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Discards messages waiting for subscriber.
+void overflowDrop(int cmsgid) {
+    for (overflow_queue **link = &overflows; *link; link = &(*link)->next) {
+        overflow_queue *queue = *link;
+        if (queue->cmsgid != cmsgid) {
+            continue;
+        }
+        while (queue->head) {
+            overflowPop(queue);
+        }
+        *link = queue->next;
+        poolFree(queue, sizeof(overflow_queue));
+        return;
+    }
+}
+
+/// @brief Finds session of cmsgid, shard 0 only.
+session *sessionFind(int cmsgid) {
+    for (int i = 0; i < SESSION_TABLE; i++) {
+        session *ses = &shared->sessions[i];
+        if (ses->state == SESSION_LIVE && ses->cmsgid == cmsgid) {
+            return ses;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Finds session slot of username, shard 0 only.
+/// @param free First free slot on the probe path, may be NULL.
+session *sessionSlot(char *username, session **free) {
+    if (free) {
+        *free = NULL;
+    }
+    unsigned int slot = mqipcHash(username);
+    for (int i = 0; i < SESSION_TABLE; i++) {
+        session *ses = &shared->sessions[(slot + i) & (SESSION_TABLE - 1)];
+        if (ses->state == SESSION_LIVE && strcmp(ses->username, username) == 0) {
+            return ses;
+        }
+        if (ses->state != SESSION_LIVE && free && !*free) {
+            *free = ses;
+        }
+        if (ses->state == SESSION_EMPTY) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Copies session of username, safe while shard 0 changes the table.
+/// @param copy Session copy.
+/// @return 1 if user is logged in, 0 otherwise.
+int sessionByName(char *username, session *copy) {
+    unsigned int slot = mqipcHash(username);
+    for (int i = 0; i < SESSION_TABLE; i++) {
+        session *ses = &shared->sessions[(slot + i) & (SESSION_TABLE - 1)];
+        unsigned int seq;
+        do {
+            seq = __atomic_load_n(&ses->seq, __ATOMIC_ACQUIRE);
+            memcpy(copy, ses, sizeof(session));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || seq != __atomic_load_n(&ses->seq, __ATOMIC_RELAXED));
+        if (copy->state == SESSION_EMPTY) {
+            return 0;
+        }
+        if (copy->state == SESSION_LIVE && strcmp(copy->username, username) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sessionWriteBegin(session *ses) {
+    __atomic_store_n(&ses->seq, ses->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void sessionWriteEnd(session *ses) {
+    __atomic_store_n(&ses->seq, ses->seq + 1, __ATOMIC_RELEASE);
+}
+
+void sessionAdd(char *username, int cmsgid, int pid, int batch) {
+    session *free;
+    session *ses = sessionSlot(username, &free);
+    if (!ses) {
+        if (!free) {
+            fprintf(stderr, "Session table is full.\n");
+            return;
+        }
+        ses = free;
+        shared->sessionsLive++;
+    }
+    sessionWriteBegin(ses);
+    ses->state = SESSION_LIVE;
+    strcpy(ses->username, username);
+    ses->cmsgid = cmsgid;
+    ses->pid = pid;
+    ses->batch = batch;
+    ses->dead = 0;
+    sessionWriteEnd(ses);
+}
+
+void sessionRemove(session *ses) {
+    sessionWriteBegin(ses);
+    ses->state = SESSION_REMOVED;
+    sessionWriteEnd(ses);
+    overflowDrop(ses->cmsgid);
+    shared->sessionsLive--;
+}
+
+enum loop_event {
+    EVENT_REQUEST = 1,      // receiver thread queued requests
+    EVENT_SIGNAL = 2,       // signal arrived
+    EVENT_FLUSH = 3,        // overflow queues are due
+    EVENT_LIVENESS = 4,     // client liveness check is due
+    EVENT_LISTEN = 5,       // gateway socket client connecting
+    EVENT_DELIVER = 6,      // other shards passed messages for socket clients
+    EVENT_CONNECTION = 16,  // gateway connection ready, plus connection slot
+};
+
+/// @brief Socket client of the gateway, known to the rest of the server by its synthetic cmsgid.
+typedef struct gateway_connection {
+    int fd;             // socket, -1 when slot is free
+    int cmsgid;         // synthetic cmsgid, -2 and below
+    int broken;         // write failed, closed once the event loop goes idle
+    int paused;         // input buffer full, reading stopped
+    long long retry;    // time to take last request again (us), 0 when not waiting
+    size_t lastFrame;   // bytes of last taken request frame
+    char *in;           // received bytes
+    size_t inStart;     // first unhandled received byte
+    size_t inLength;    // unhandled received bytes
+    char *out;          // ring of bytes waiting for the socket
+    size_t outSize;     // ring capacity
+    size_t outStart;    // first unsent byte
+    size_t outLength;   // unsent bytes
+} gateway_connection;
+
+/// @brief Message for socket client passed by the shard that handled it to shard 0 over gatewayChannel.
+typedef struct msg_gateway_deliver {
+    long mtype;  // M_GATEWAY_DELIVER
+    int cmsgid;  // synthetic cmsgid of socket client
+    int length;  // message length, mtype included
+    char data[sizeof(msg_batch)];
+} msg_gateway_deliver;
+
+/// @brief Client request as received from server queue.
+typedef union request {
+    long mtype;
+#define REQUEST_MEMBER(type, value, layout, name) layout layout;
+    MQIPC_REQUESTS(REQUEST_MEMBER)
+#undef REQUEST_MEMBER
+} request;
+
+gateway_connection gateway[GATEWAY_CONNECTIONS];
+int gatewayListeners[2] = {-1, -1};    // Unix and TCP sockets
+int gatewayNext = 1;                   // last synthetic cmsgid number given out
+int gatewayPending = 0;                // connections with unsent output
+int gatewayWaiting = 0;                // connections with a put back request
+int gatewayChannel[2] = {-1, -1};      // deliveries of other shards, read by shard 0 from [0], sent to [1]
+int eventLoop = -1;                    // epoll instance of this shard
+unsigned long gatewayAccepted = 0;     // connections accepted
+unsigned long gatewayFrames = 0;       // frames queued to socket clients
+unsigned long gatewayWrites = 0;       // writev calls
+unsigned long gatewayPassed = 0;       // messages passed to shard 0
+unsigned long gatewayPassBusy = 0;     // messages shard 0 did not take in time
+
+/// @brief Finds gateway connection of synthetic cmsgid.
+/// @return Connection, NULL if client has disconnected.
+gateway_connection *gatewayFind(int cmsgid) {
+    if (cmsgid > -2) {
+        return NULL;
+    }
+    gateway_connection *conn = &gateway[(-cmsgid - 2) % GATEWAY_CONNECTIONS];
+    return conn->fd != -1 && conn->cmsgid == cmsgid ? conn : NULL;
+}
+
+/// @brief Sets events gateway connection waits for.
+void gatewayWatch(gateway_connection *conn) {
+    struct epoll_event ev = {0, {.u32 = EVENT_CONNECTION + (conn - gateway)}};
+    if (!conn->paused) {
+        ev.events |= EPOLLIN;
+    }
+    if (conn->outLength) {
+        ev.events |= EPOLLOUT;
+    }
+    epoll_ctl(eventLoop, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/// @brief Opens gateway sockets, Unix socket at config.gatewayPath and TCP at config.gatewayPort on loopback.
+void gatewayListen() {
+    for (int i = 0; i < GATEWAY_CONNECTIONS; i++) {
+        gateway[i].fd = -1;
+    }
+    if (config.gatewayPath) {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, config.gatewayPath, sizeof(addr.sun_path) - 1);
+        unlink(config.gatewayPath);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+            printError("Failed to open gateway socket.");
+            exit(1);
+        }
+        gatewayListeners[0] = fd;
+    }
+    if (config.gatewayPort) {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(config.gatewayPort);
+        int reuse = 1;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+            printError("Failed to open gateway port.");
+            exit(1);
+        }
+        gatewayListeners[1] = fd;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event ev = {EPOLLIN, {.u32 = EVENT_LISTEN}};
+        if (gatewayListeners[i] != -1 && epoll_ctl(eventLoop, EPOLL_CTL_ADD, gatewayListeners[i], &ev) == -1) {
+            printError("Failed to listen on gateway.");
+            exit(1);
+        }
+    }
+}
+
+/// @brief Accepts waiting socket clients.
+void gatewayAccept() {
+    for (int i = 0; i < 2; i++) {
+        int fd;
+        while (gatewayListeners[i] != -1 && (fd = accept(gatewayListeners[i], NULL, NULL)) != -1) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            // find free slot, cmsgid maps back to it
+            int id = gatewayNext;
+            int tries = 0;
+            do {
+                id = id == INT_MAX - 2 ? 1 : id + 1;
+            } while (gateway[(id - 1) % GATEWAY_CONNECTIONS].fd != -1 && ++tries < GATEWAY_CONNECTIONS);
+            gateway_connection *conn = &gateway[(id - 1) % GATEWAY_CONNECTIONS];
+            if (conn->fd != -1) {
+                fprintf(stderr, "Too many gateway connections.\n");
+                close(fd);
+                continue;
+            }
+            gatewayNext = id;
+            if (i == 1) {
+                // frames are batched by writev, do not wait for more data
+                int nodelay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            }
+            char *in = malloc(GATEWAY_BUFFER), *out = malloc(GATEWAY_BUFFER);
+            if (!in || !out) {
+                printError("Failed to allocate gateway buffers.");
+                free(in);
+                free(out);
+                close(fd);
+                continue;
+            }
+            *conn = (gateway_connection){fd, -id - 1, 0, 0, 0, 0, in, 0, 0, out, GATEWAY_BUFFER, 0, 0};
+            struct epoll_event ev = {EPOLLIN, {.u32 = EVENT_CONNECTION + (conn - gateway)}};
+            epoll_ctl(eventLoop, EPOLL_CTL_ADD, fd, &ev);
+            gatewayAccepted++;
+            printf("Gateway client connected: #%d\n", conn->cmsgid);
+        }
+    }
+}
+
+/// @brief Closes gateway connection and logs its user out.
+void gatewayClose(gateway_connection *conn) {
+    printf("Gateway client disconnected: #%d\n", conn->cmsgid);
+    session *ses = sessionFind(conn->cmsgid);
+    if (ses) {
+        dbRemoveUser(conn->cmsgid);
+        sessionRemove(ses);
+    }
+    if (conn->outLength) {
+        gatewayPending--;
+    }
+    if (conn->retry) {
+        gatewayWaiting--;
+    }
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    conn->fd = -1;
+}
+
+/// @brief Reads bytes available on gateway connection.
+void gatewayRead(gateway_connection *conn) {
+    // move unhandled bytes to the front
+    memmove(conn->in, conn->in + conn->inStart, conn->inLength);
+    conn->inStart = 0;
+    while (conn->inLength < GATEWAY_BUFFER) {
+        ssize_t length = read(conn->fd, conn->in + conn->inLength, GATEWAY_BUFFER - conn->inLength);
+        if (length > 0) {
+            conn->inLength += length;
+            continue;
+        }
+        if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        gatewayClose(conn);
+        return;
+    }
+    // stop reading until queued requests are handled
+    conn->paused = 1;
+    gatewayWatch(conn);
+}
+
+/// @brief Terminates string fields of request, clients may send them without NUL.
+/// @param req Request of any request type.
+void requestTerminate(request *req) {
+#define TERMINATE(field) (field)[sizeof(field) - 1] = '\0'
+    switch (req->mtype) {
+        case M_LOGIN:
+            TERMINATE(req->msg_login.username);
+            break;
+        case M_CREATE_ROOM:
+            TERMINATE(req->msg_create_room.room_name);
+            break;
+        case M_JOIN_ROOM:
+            TERMINATE(req->msg_join_room.username);
+            TERMINATE(req->msg_join_room.room_name);
+            break;
+        case M_SEND_MESSAGE:
+            TERMINATE(req->msg_send_message.author);
+            TERMINATE(req->msg_send_message.room_name);
+            TERMINATE(req->msg_send_message.message);
+            break;
+    }
+#undef TERMINATE
+}
+
+/// @brief Takes next complete request received by gateway, connections take turns.
+/// @param req Request copy, cmsgid set to synthetic cmsgid of the connection.
+/// @return 1 if request was taken, 0 if none is waiting.
+int gatewayTake(request *req) {
+    static int turn = 0;
+    for (int i = 0; i < GATEWAY_CONNECTIONS; i++) {
+        gateway_connection *conn = &gateway[turn];
+        turn = (turn + 1) % GATEWAY_CONNECTIONS;
+        if (conn->fd == -1 || conn->inLength < sizeof(uint32_t)) {
+            continue;
+        }
+        if (conn->retry) {
+            if (nowUsec() < conn->retry) {
+                continue;
+            }
+            conn->retry = 0;
+            gatewayWaiting--;
+        }
+        uint32_t length;
+        memcpy(&length, conn->in + conn->inStart, sizeof(length));
+        if (length < sizeof(long) + sizeof(int) || length > sizeof(request)) {
+            fprintf(stderr, "Invalid gateway frame from #%d.\n", conn->cmsgid);
+            gatewayClose(conn);
+            continue;
+        }
+        if (conn->inLength < sizeof(length) + length) {
+            continue;
+        }
+        long type;
+        memcpy(&type, conn->in + conn->inStart + sizeof(length), sizeof(type));
+        if (!mqipcRequest(type) || length > sizeof(long) + mqipcPayloads[type]) {
+            fprintf(stderr, "Invalid gateway request from #%d.\n", conn->cmsgid);
+            gatewayClose(conn);
+            continue;
+        }
+        // shorter frames leave trailing fields empty
+        memset(req, 0, sizeof(long) + mqipcPayloads[type]);
+        memcpy(req, conn->in + conn->inStart + sizeof(length), length);
+        conn->lastFrame = sizeof(length) + length;
+        conn->inStart += conn->lastFrame;
+        conn->inLength -= conn->lastFrame;
+        // every request starts with client cmsgid
+        req->msg_logout.cmsgid = conn->cmsgid;
+        if (req->mtype == M_SEND_MESSAGE) {
+            req->msg_send_message.stamps[MQIPC_RECEIVED] = nowUsec();
+        }
+        if (req->mtype == M_LOGIN) {
+            req->msg_login.pid = 0;
+        }
+        requestTerminate(req);
+        if (conn->paused) {
+            conn->paused = 0;
+            gatewayWatch(conn);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief Puts last taken request back, it is taken again after a while.
+/// @param cmsgid Synthetic cmsgid.
+/// @return 1 if request was put back, 0 if client is gone.
+int gatewayUntake(int cmsgid) {
+    gateway_connection *conn = gatewayFind(cmsgid);
+    if (!conn) {
+        return 0;
+    }
+    // input is only compacted by gatewayRead(), frame is still in place
+    conn->inStart -= conn->lastFrame;
+    conn->inLength += conn->lastFrame;
+    if (!conn->retry) {
+        gatewayWaiting++;
+    }
+    conn->retry = nowUsec() + OVERFLOW_RETRY;
+    return 1;
+}
+
+/// @brief Finds earliest time a put back request is taken again.
+/// @return Time (us), 0 if no request waits.
+long long gatewayRetry() {
+    long long due = 0;
+    for (int i = 0; i < GATEWAY_CONNECTIONS; i++) {
+        if (gateway[i].fd != -1 && gateway[i].retry && (!due || gateway[i].retry < due)) {
+            due = gateway[i].retry;
+        }
+    }
+    return due;
+}
+
+/// @brief Writes buffered output of gateway connection, wrapped ring in one writev call.
+void gatewayWrite(gateway_connection *conn) {
+    while (conn->outLength && !conn->broken) {
+        size_t first = conn->outSize - conn->outStart;
+        struct iovec iov[2] = {{conn->out + conn->outStart, conn->outLength < first ? conn->outLength : first}, {conn->out, 0}};
+        iov[1].iov_len = conn->outLength - iov[0].iov_len;
+        gatewayWrites++;
+        ssize_t length = writev(conn->fd, iov, iov[1].iov_len ? 2 : 1);
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                conn->broken = 1;
+            }
+            break;
+        }
+        conn->outStart = (conn->outStart + length) % conn->outSize;
+        conn->outLength -= length;
+        if (!conn->outLength) {
+            gatewayPending--;
+        }
+    }
+    gatewayWatch(conn);
+}
+
+/// @brief Queues message for socket client.
+/// @param cmsgid Synthetic cmsgid.
+/// @param msg Message, starting with mtype.
+/// @param size Message size without mtype, as for msgsnd.
+/// @param grow Enlarge output buffer up to config.maxBuffered instead of failing when it is full.
+/// @return 0 on success, -1 with errno EAGAIN if output is full, ENOBUFS if it reached its limit, EIDRM if client is gone.
+int gatewaySend(int cmsgid, void *msg, size_t size, int grow) {
+    gateway_connection *conn = gatewayFind(cmsgid);
+    if (!conn || conn->broken) {
+        errno = EIDRM;
+        return -1;
+    }
+    uint32_t length = size + sizeof(long);
+    size_t frame = sizeof(length) + length;
+    if (conn->outLength + frame > conn->outSize) {
+        if (!grow) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (conn->outLength + frame > (size_t)config.maxBuffered) {
+            bufferDropped++;
+            errno = ENOBUFS;
+            return -1;
+        }
+        // unwrap ring into larger buffer
+        size_t outSize = conn->outSize;
+        while (conn->outLength + frame > outSize) {
+            outSize *= 2;
+        }
+        char *out = malloc(outSize);
+        if (!out) {
+            // drop the client rather than its frames, closed once the event loop goes idle
+            printError("Failed to grow gateway output.");
+            conn->broken = 1;
+            errno = ENOBUFS;
+            return -1;
+        }
+        for (size_t i = 0; i < conn->outLength; i++) {
+            out[i] = conn->out[(conn->outStart + i) % conn->outSize];
+        }
+        free(conn->out);
+        conn->out = out;
+        conn->outSize = outSize;
+        conn->outStart = 0;
+    }
+    if (!conn->outLength) {
+        gatewayPending++;
+    }
+    // append frame, wrapping around ring end
+    char *parts[2] = {(char *)&length, msg};
+    size_t sizes[2] = {sizeof(length), length};
+    for (int p = 0; p < 2; p++) {
+        size_t end = (conn->outStart + conn->outLength) % conn->outSize;
+        size_t first = conn->outSize - end < sizes[p] ? conn->outSize - end : sizes[p];
+        memcpy(conn->out + end, parts[p], first);
+        memcpy(conn->out, parts[p] + first, sizes[p] - first);
+        conn->outLength += sizes[p];
+    }
+    gatewayFrames++;
+    if (conn->outLength >= GATEWAY_FLUSH) {
+        gatewayWrite(conn);
+    }
+    return 0;
+}
+
+/// @brief Writes output of every gateway connection and closes broken ones.
+void gatewayFlush() {
+    for (int i = 0; gatewayPending && i < GATEWAY_CONNECTIONS; i++) {
+        if (gateway[i].fd != -1 && gateway[i].outLength) {
+            gatewayWrite(&gateway[i]);
+        }
+    }
+    for (int i = 0; i < GATEWAY_CONNECTIONS; i++) {
+        if (gateway[i].fd != -1 && gateway[i].broken) {
+            gatewayClose(&gateway[i]);
+        }
+    }
+}
+
+/// @brief Sends message to client queue, or to gateway connection of socket client.
+/// @param cmsgid Client cmsgid.
+/// @param msg Message, starting with mtype.
+/// @param size Message size without mtype.
+/// @return 0 on success, -1 with errno set as by msgsnd.
+int clientSend(int cmsgid, void *msg, size_t size) {
+    if (cmsgid >= 0) {
+        return msgsnd(cmsgid, msg, size, IPC_NOWAIT);
+    }
+    if (shardId == 0) {
+        return gatewaySend(cmsgid, msg, size, 0);
+    }
+    // gateway runs in shard 0, reached over a channel only server processes hold. Waiting is
+    // bounded: shard 0 stops taking deliveries while it waits for other shards to exit.
+    if (gatewayChannel[1] == -1) {
+        errno = EIDRM;
+        return -1;
+    }
+    msg_gateway_deliver deliver;
+    deliver.mtype = M_GATEWAY_DELIVER;
+    deliver.cmsgid = cmsgid;
+    deliver.length = size + sizeof(long);
+    memcpy(deliver.data, msg, deliver.length);
+    for (int tries = 0; tries < GATEWAY_PASS_RETRIES; tries++) {
+        if (send(gatewayChannel[1], &deliver, offsetof(msg_gateway_deliver, data) + deliver.length, MSG_DONTWAIT | MSG_NOSIGNAL) != -1) {
+            gatewayPassed++;
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        usleep(100);
+    }
+    // as for a full client queue, deliveries wait in the overflow queue and responses are lost
+    gatewayPassBusy++;
+    errno = EAGAIN;
+    return -1;
+}
+
+/// @brief Checks if client of a failed send is gone. EINVAL from msgsnd also means an invalid
+/// message, so the queue itself is checked.
+/// @param cmsgid Client cmsgid.
+/// @return 1 if client is gone, 0 with errno of the failed send otherwise.
+int clientGone(int cmsgid) {
+    int error = errno;
+    if (cmsgid < 0) {
+        return error == EIDRM;  // connection closed
+    }
+    struct msqid_ds ds;
+    if (msgctl(cmsgid, IPC_STAT, &ds) == -1 && (errno == EINVAL || errno == EIDRM)) {
+        return 1;
+    }
+    errno = error;
+    return 0;
+}
+
+/// @brief Marks session of subscriber whose queue is gone, shard 0 reaps it on next liveness check.
+void sessionLost(int cmsgid) {
+    session *ses = sessionFind(cmsgid);
+    if (ses && !__atomic_exchange_n(&ses->dead, 1, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&shared->lost, 1, __ATOMIC_RELEASE);
+        // wake shard 0 event loop
+        if (shardId != 0) {
+            kill(shardPids[0], SIGUSR2);
+        }
+    }
+}
+
+/// @brief Checks if client still owns its queue.
+/// @param ses Session.
+/// @return 1 if client is alive, 0 otherwise.
+int sessionAlive(session *ses) {
+    if (__atomic_load_n(&ses->dead, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (ses->cmsgid < 0) {
+        gateway_connection *conn = gatewayFind(ses->cmsgid);
+        return conn && !conn->broken;
+    }
+    struct msqid_ds ds;
+    if (msgctl(ses->cmsgid, IPC_STAT, &ds) == -1) {
+        return errno != EINVAL && errno != EIDRM;  // queue removed
+    }
+    if (ses->pid) {
+        return kill(ses->pid, 0) == 0 || errno != ESRCH;
+    }
+    // owner unknown (session from before restart), check last queue users
+    if (!ds.msg_lrpid && !ds.msg_lspid) {
+        return 1;
+    }
+    pid_t pids[2] = {ds.msg_lrpid, ds.msg_lspid};
+    for (int i = 0; i < 2; i++) {
+        if (pids[i] && pids[i] != getpid() && (kill(pids[i], 0) == 0 || errno != ESRCH)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// @brief Logs out dead client and deletes its orphaned queue.
+void sessionReap(session *ses) {
+    printf("Removing dead client: %s #%d\n", ses->username, ses->cmsgid);
+    if (ses->cmsgid > 0) {
+        msgctl(ses->cmsgid, IPC_RMID, NULL);
+    }
+    dbRemoveUser(ses->cmsgid);
+    sessionRemove(ses);
+    shared->sessionsReaped++;
+}
+
+/// @brief Reaps every session whose client is gone.
+void sessionSweep() {
+    for (int i = 0; i < SESSION_TABLE; i++) {
+        session *ses = &shared->sessions[i];
+        if (ses->state == SESSION_LIVE && !sessionAlive(ses)) {
+            sessionReap(ses);
+        }
+    }
+}
+
+/// @brief Restores sessions of users logged in before server restart.
+void sessionLoad() {
+    for (int i = 0; i < db->userCount; i++) {
+        if (db->users[i].cmsgid > 0) {
+            sessionAdd(db->users[i].name, db->users[i].cmsgid, 0, 0);
+        }
+    }
+}
+
+/// @brief Delivers message to subscriber, keeping it in overflow queue if subscriber queue is full.
+/// @param ses Subscriber session.
+/// @param buf Message buffer, one reference is taken for the delivery.
+void deliverMessage(session *ses, msg_buffer *buf) {
+    bufferRetain(buf);
+    deliveries++;
+    // keep order behind messages already waiting
+    overflow_queue *queue = overflowFind(ses->cmsgid);
+    int batch = config.batchBytes && ses->batch;
+    if (queue || batch) {
+        overflowPush(queue, ses->cmsgid, batch, buf);
+        return;
+    }
+    printf("Sending message to: %d\n", ses->cmsgid);
+    deliverySends++;
+    buf->msg.stamps[MQIPC_ENQUEUED] = nowUsec();
+    if (clientSend(ses->cmsgid, &buf->msg, MQIPC_PAYLOAD(msg_send_message)) == -1) {
+        if (errno == EAGAIN) {
+            overflowPush(NULL, ses->cmsgid, 0, buf);
+            return;
+        }
+        if (clientGone(ses->cmsgid)) {
+            sessionLost(ses->cmsgid);
+        } else {
+            printError("Failed to send message.");
+        }
+    }
+    bufferRelease(buf);
+}
+
+/// @brief Packs waiting messages into one batch frame and sends it.
+/// @param queue Subscriber overflow queue.
+/// @return Number of messages sent, -1 on error.
+int batchSend(overflow_queue *queue) {
+    batchFrame.mtype = 10;
+    batchFrame.cmsgid = MQIPC_BATCH_FRAME;
+    batchFrame.count = 0;
+    batchFrame.length = 0;
+    long long now = nowUsec();
+    for (overflow_node *node = queue->head; node && batchFrame.length + node->size <= config.batchBytes; node = node->next) {
+        msg_send_message *msg = &node->buf->msg;
+        msg_batch_entry entry;
+        entry.priority = msg->priority;
+        entry.author_length = strlen(msg->author);
+        entry.room_length = strlen(msg->room_name);
+        entry.message_length = strlen(msg->message);
+        entry.sequence = msg->sequence;
+        memcpy(entry.stamps, msg->stamps, sizeof(entry.stamps));
+        entry.stamps[MQIPC_ENQUEUED] = now;
+        char *pos = batchFrame.data + batchFrame.length;
+        memcpy(pos, &entry, sizeof(entry));
+        pos += sizeof(entry);
+        memcpy(pos, msg->author, entry.author_length);
+        pos += entry.author_length;
+        memcpy(pos, msg->room_name, entry.room_length);
+        pos += entry.room_length;
+        memcpy(pos, msg->message, entry.message_length);
+        batchFrame.length += node->size;
+        batchFrame.count++;
+        // frame is received with the most urgent packed message
+        if (msg->priority < batchFrame.mtype) {
+            batchFrame.mtype = msg->priority;
+        }
+    }
+    printf("Sending %d messages to: %d\n", batchFrame.count, queue->cmsgid);
+    deliverySends++;
+    if (clientSend(queue->cmsgid, &batchFrame, offsetof(msg_batch, data) - sizeof(long) + batchFrame.length) == -1) {
+        return -1;
+    }
+    batchFrames++;
+    return batchFrame.count;
+}
+
+/// @brief Sends messages waiting in overflow queues, batch frames once they are full or old enough.
+/// @return Time of next flush (us), 0 if no messages wait.
+long long overflowFlush() {
+    long long now = nowUsec();
+    long long due = 0;
+    overflow_queue **link = &overflows;
+    while (*link) {
+        overflow_queue *queue = *link;
+        while (queue->head) {
+            int sent = 1;
+            if (queue->batch) {
+                if (queue->bytes < config.batchBytes && now - queue->head->queued < config.batchDelay) {
+                    // batch frame not due yet
+                    if (!due || queue->head->queued + config.batchDelay < due) {
+                        due = queue->head->queued + config.batchDelay;
+                    }
+                    break;
+                }
+                sent = batchSend(queue);
+            } else {
+                deliverySends++;
+                queue->head->buf->msg.stamps[MQIPC_ENQUEUED] = now;
+                if (clientSend(queue->cmsgid, &queue->head->buf->msg, MQIPC_PAYLOAD(msg_send_message)) == -1) {
+                    sent = -1;
+                }
+            }
+            if (sent == -1) {
+                if (errno == EAGAIN) {
+                    // subscriber queue still full
+                    if (!due || now + OVERFLOW_RETRY < due) {
+                        due = now + OVERFLOW_RETRY;
+                    }
+                    break;
+                }
+                if (clientGone(queue->cmsgid)) {
+                    sessionLost(queue->cmsgid);
+                } else {
+                    printError("Failed to send message.");
+                }
+                sent = 1;
+            }
+            while (sent--) {
+                overflowPop(queue);
+            }
+        }
+        if (queue->head) {
+            link = &queue->next;
+            continue;
+        }
+        // subscriber caught up
+        *link = queue->next;
+        poolFree(queue, sizeof(overflow_queue));
+    }
+    return due;
+}
+
+token_bucket *authorBuckets[BUCKET_TABLE];
+token_bucket *roomBuckets[BUCKET_TABLE];
+int authorBucketCount = 0;          // author buckets, at most config.maxUsers
+int roomBucketCount = 0;            // room buckets, at most config.maxRooms
+unsigned long throttledAuthor = 0;  // messages rejected by author limit
+unsigned long throttledRoom = 0;    // messages rejected by room limit
+
+/// @brief Frees buckets refilled to full, a new bucket starts the same.
+/// @param table Bucket hash table.
+/// @param count Bucket counter of the table.
+/// @param rate Tokens added per second.
+/// @param burst Bucket capacity.
+/// @param now Current time (us).
+void bucketSweep(token_bucket **table, int *count, double rate, double burst, long long now) {
+    for (int i = 0; i < BUCKET_TABLE; i++) {
+        token_bucket **link = &table[i];
+        while (*link) {
+            token_bucket *bucket = *link;
+            if (bucket->tokens + (now - bucket->updated) * rate / 1000000.0 < burst) {
+                link = &bucket->next;
+                continue;
+            }
+            *link = bucket->next;
+            poolFree(bucket, sizeof(token_bucket));
+            (*count)--;
+        }
     }
-    fclose(users);
-    // crate rooms database
-    FILE *rooms = fopen(ROOMS_DB, "a");
-    if (!rooms) {
-        printError("Failed to create rooms database.");
-        exit(1);
+}
+
+/// @brief Finds bucket of name and refills it for the time passed.
+/// @param table Bucket hash table.
+/// @param count Bucket counter of the table.
+/// @param limit Buckets table may hold at most.
+/// @param name Author or room name.
+/// @param rate Tokens added per second.
+/// @param burst Bucket capacity.
+/// @param now Current time (us).
+/// @return Refilled bucket, NULL if table holds limit buckets that are all in use.
+token_bucket *bucketRefill(token_bucket **table, int *count, int limit, char *name, double rate, double burst, long long now) {
+    unsigned int hash = 5381;
+    for (char *c = name; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
     }
-    fclose(rooms);
-    // create keys database
-    FILE *keys = fopen(KEYS_DB, "a");
-    if (!keys) {
-        printError("Failed to create keys database.");
-        exit(1);
+    token_bucket **link = &table[hash % BUCKET_TABLE];
+    while (*link && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    token_bucket *bucket = *link;
+    if (!bucket) {
+        if (*count >= limit) {
+            bucketSweep(table, count, rate, burst, now);
+            if (*count >= limit) {
+                return NULL;
+            }
+            // sweep may have unlinked the end of the chain
+            link = &table[hash % BUCKET_TABLE];
+            while (*link) {
+                link = &(*link)->next;
+            }
+        }
+        // new buckets start full
+        bucket = poolAlloc(sizeof(token_bucket));
+        (*count)++;
+        strcpy(bucket->name, name);
+        bucket->tokens = burst;
+        bucket->updated = now;
+        bucket->next = NULL;
+        *link = bucket;
+        return bucket;
     }
-    fclose(keys);
+    bucket->tokens += (now - bucket->updated) * rate / 1000000.0;
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+    bucket->updated = now;
+    return bucket;
 }
 
-/// @brief Checks if user exists.
-/// @param username Username.
-/// @return User cmsgid if user exists (including 0 when logged out), negative value of next id otherwise.
-int dbUserExists(char *username) {
-    // open users database
-    FILE *users = fopen(USERS_DB, "r");
-    if (!users) {
-        printError("Failed to open users database.");
-        exit(1);
+/// @brief Takes publish tokens from author and room buckets.
+/// @param author Author name.
+/// @param room_name Room name.
+/// @return 0 if message may be published, 1 if author is over limit, 2 if room is over limit.
+int rateLimit(char *author, char *room_name) {
+    if (!config.authorRate && !config.roomRate) {
+        return 0;
     }
-    // read database line by line
-    char name[32];
-    int id = 0, cmsgid;
-    while (fscanf(users, "%d %s %d", &id, name, &cmsgid) == 3) {
-        if (strcmp(name, username) == 0) {
-            fclose(users);
-            return cmsgid;  // User exists
+    long long now = nowUsec();
+    token_bucket *author_bucket = NULL, *room_bucket = NULL;
+    if (config.authorRate) {
+        author_bucket = bucketRefill(authorBuckets, &authorBucketCount, config.maxUsers, author, config.authorRate, config.authorBurst, now);
+        if (!author_bucket || author_bucket->tokens < 1) {
+            throttledAuthor++;
+            return 1;
         }
     }
-    fclose(users);
-    // username does not exist
-    return -(++id);
+    if (config.roomRate) {
+        room_bucket = bucketRefill(roomBuckets, &roomBucketCount, config.maxRooms, room_name, config.roomRate, config.roomBurst, now);
+        if (!room_bucket || room_bucket->tokens < 1) {
+            throttledRoom++;
+            return 2;
+        }
+    }
+    // take tokens only when both limits pass
+    if (author_bucket) {
+        author_bucket->tokens--;
+    }
+    if (room_bucket) {
+        room_bucket->tokens--;
+    }
+    return 0;
 }
 
-int dbEditUser(char *username, int cmsgid) {
-    // open users database
-    FILE *users = fopen(USERS_DB, "r");
-    if (!users) {
-        printError("Failed to open users database.");
+/// @brief Parses rate limit setting.
+/// @param arg Setting in rate[:burst] format.
+/// @param rate Messages per second.
+/// @param burst Messages at once, defaults to rate (at least 1).
+void parseRate(char *arg, double *rate, double *burst) {
+    char *end;
+    *rate = strtod(arg, &end);
+    *burst = *end == ':' ? strtod(end + 1, NULL) : *rate;
+    if (*burst < 1) {
+        *burst = 1;
+    }
+}
+
+/// @brief Parses limits setting.
+/// @param arg Setting in users:rooms:subscribers:buffered_bytes format, empty or 0 fields keep the default.
+void parseLimits(char *arg) {
+    int *limits[4] = {&config.maxUsers, &config.maxRooms, &config.maxSubscribers, &config.maxBuffered};
+    for (int i = 0; i < 4 && *arg; i++) {
+        char *end;
+        long value = strtol(arg, &end, 10);
+        if (value > 0) {
+            *limits[i] = value > INT_MAX ? INT_MAX : value;
+        }
+        arg = *end == ':' ? end + 1 : end;
+    }
+}
+
+void respondNow(int cmsgid, msg_response *response) {
+    printf("Sending response to: %d\n", cmsgid);
+    if (clientSend(cmsgid, response, MQIPC_PAYLOAD(msg_response)) == -1) {
+        printError("Failed to send response.");
+    }
+}
+
+/// @brief Sends response, holding it back until uncommitted changes are durable.
+/// @param cmsgid Client cmsgid.
+/// @param response Response, copied when held back.
+void respond(int cmsgid, msg_response *response) {
+    if (!dbDirty) {
+        respondNow(cmsgid, response);
+        return;
+    }
+    response_node *node = poolAlloc(sizeof(response_node));
+    node->cmsgid = cmsgid;
+    node->response = *response;
+    node->next = NULL;
+    *responsesTail = node;
+    responsesTail = &node->next;
+    responsesDeferred++;
+}
+
+/// @brief Responds to request with status and message.
+/// @param cmsgid Client cmsgid.
+/// @param status Response status.
+/// @param message Response message.
+void respondStatus(int cmsgid, int status, const char *message) {
+    msg_response *response = arenaAlloc(&requestArena, sizeof(msg_response));
+    response->mtype = M_RESPONSE;
+    response->status = status;
+    strcpy(response->message, message);
+    respond(cmsgid, response);
+}
+
+/// @brief Sends responses held back for the last commit.
+void responseFlush() {
+    while (responses) {
+        response_node *node = responses;
+        responses = node->next;
+        respondNow(node->cmsgid, &node->response);
+        poolFree(node, sizeof(response_node));
+    }
+    responsesTail = &responses;
+    responsesDeferred = 0;
+}
+
+int ringCompare(const void *a, const void *b) {
+    unsigned int x = ((mqipc_ring_point *)a)->hash, y = ((mqipc_ring_point *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/// @brief Creates state shared by all shards and places shards on the routing ring.
+void sharedInit() {
+    // remove state left by a server that did not shut down
+    int stale = shmget(MQIPC_SERVER, 0, 0);
+    if (stale != -1) {
+        shmctl(stale, IPC_RMID, NULL);
+    }
+    sharedId = shmget(MQIPC_SERVER, sizeof(shared_state), 0644 | IPC_CREAT | IPC_EXCL);
+    if (sharedId == -1) {
+        printError("Failed to create shared memory.");
         exit(1);
     }
-    // open temp database
-    FILE *temp = fopen(TEMP_DB, "w");
-    if (!temp) {
-        printError("Failed to open temp database.");
+    shared = shmat(sharedId, NULL, 0);
+    if (shared == (void *)-1) {
+        printError("Failed to attach shared memory.");
+        shmctl(sharedId, IPC_RMID, NULL);
         exit(1);
     }
-    // read database line by line
-    char name[32];
-    int tmp, key, edit = 0;
-    while (fscanf(users, "%d %s %d", &tmp, name, &key) == 3) {
-        if (strcmp(name, username) == 0) {
-            fprintf(temp, "%d %s %d\n", tmp, name, cmsgid);
-            edit = 1;
-        } else {
-            fprintf(temp, "%d %s %d\n", tmp, name, key);
+    memset(shared, 0, sizeof(shared_state));
+    dbRoomsTotal = &shared->rooms;
+    mqipc_routing *routing = &shared->routing;
+    routing->shards = config.shards;
+    for (int s = 0; s < config.shards; s++) {
+        for (int i = 0; i < MQIPC_RING_POINTS; i++) {
+            char point[32];
+            snprintf(point, sizeof(point), "shard-%d-%d", s, i);
+            routing->ring[routing->points].hash = mqipcHash(point);
+            routing->ring[routing->points].shard = s;
+            routing->points++;
         }
     }
-    fclose(users);
-    fclose(temp);
-    if (edit) {
-        // remove users database
-        remove(USERS_DB);
-        // rename temp database
-        rename(TEMP_DB, USERS_DB);
-        return 0;  // User exists
+    qsort(routing->ring, routing->points, sizeof(mqipc_ring_point), ringCompare);
+}
+
+void shardDir(int shard, char *dir) {
+    if (shard == 0) {
+        strcpy(dir, DATABASE_DIR);
+    } else {
+        sprintf(dir, "%s/shard%d", DATABASE_DIR, shard);
     }
-    return 1;  // User does not exist
 }
 
-int dbAddUser(char *username, int cmsgid) {
-    int tmp = dbUserExists(username);
-    if (tmp > 0) {
-        return tmp;
+/// @brief Loads tables of every shard and moves rooms to the shards owning them on the ring.
+/// @param tables Tables of each shard, NULL for unused shards without tables.
+void shardBalance(database **tables) {
+    int dirty[MQIPC_MAX_SHARDS] = {0};
+    char dir[64];
+    for (int s = 0; s < MQIPC_MAX_SHARDS; s++) {
+        shardDir(s, dir);
+        struct stat st;
+        tables[s] = NULL;
+        if (s >= config.shards && stat(dir, &st) == -1) {
+            continue;
+        }
+        tables[s] = s == 0 ? &dbTables : calloc(1, sizeof(database));
+        if (!tables[s]) {
+            printError("Failed to allocate shard tables.");
+            exit(1);
+        }
+        db = tables[s];
+        dbDirty = 0;
+        dbOpen(dir, s == 0);
+        dirty[s] = dbDirty;
     }
-    if (tmp == 0) {
-        return dbEditUser(username, cmsgid);
+    // rooms change owner when the number of shards changes
+    int moved = 0;
+    for (int s = 0; s < MQIPC_MAX_SHARDS; s++) {
+        for (int i = 0; tables[s] && i < tables[s]->roomCount; i++) {
+            db_room room = tables[s]->rooms[i];
+            int owner = mqipcShard(&shared->routing, room.name);
+            if (owner == s) {
+                continue;
+            }
+            // add room and its subscribtions to owner
+            db = tables[owner];
+            dbDirty = dirty[owner];
+            if (dbAddRoom(room.name) == -1) {
+                fprintf(stderr, "Shard %d is full, room %s stays unreachable on shard %d.\n", owner, room.name, s);
+                continue;
+            }
+            for (int k = 0; k < tables[s]->keyCount; k++) {
+                db_key *key = &tables[s]->keys[k];
+                if (key->room == room.id) {
+                    dbJoinRoom(room.name, key->user, key->subscribtion, INT_MAX);
+                }
+            }
+            dirty[owner] = dbDirty;
+            // remove them from previous owner
+            db = tables[s];
+            dbDirty = dirty[s];
+            for (int k = 0; k < db->keyCount; k++) {
+                if (db->keys[k].room == room.id) {
+                    dbRemoveKey(k--);
+                }
+            }
+            dbRemoveRoom(i--);
+            dirty[s] = dbDirty;
+            moved++;
+        }
     }
-    // open users database
-    FILE *users = fopen(USERS_DB, "a");
-    if (!users) {
-        printError("Failed to open users database.");
-        exit(1);
+    for (int s = 0; s < MQIPC_MAX_SHARDS; s++) {
+        if (tables[s] && dirty[s]) {
+            db = tables[s];
+            shardDir(s, dbDir);
+            dbDirty = dirty[s];
+            dbCommit(0);
+        }
     }
-    fprintf(users, "%d %s %d\n", -tmp, username, cmsgid);
-    // close users database
-    fclose(users);
-    return 0;
+    if (moved) {
+        printf("Moved %d rooms between shards.\n", moved);
+    }
+    // stored rooms stay when the limit was lowered, new ones are refused
+    shared->rooms = 0;
+    for (int s = 0; s < MQIPC_MAX_SHARDS; s++) {
+        if (tables[s]) {
+            shared->rooms += tables[s]->roomCount;
+        }
+    }
+    // publish room names before shards start
+    for (int s = 0; s < config.shards; s++) {
+        for (int i = 0; i < tables[s]->roomCount; i++) {
+            strcpy(shared->roomNames[s][i], tables[s]->rooms[i].name);
+        }
+        shared->roomsListed[s] = tables[s]->roomCount;
+    }
+    db = &dbTables;
+    strcpy(dbDir, DATABASE_DIR);
 }
 
-void dbRemoveUser(int cmsgid) {
-    // open users database
-    FILE *users = fopen(USERS_DB, "r");
-    if (!users) {
-        printError("Failed to open users database.");
-        exit(1);
+FILE *trace = NULL;             // capture file of this shard
+unsigned long traceRecords = 0;  // requests captured
+int traceDirty = 0;              // records buffered since last flush
+int requestForwarded = 0;        // request being handled was passed to its owner shard, not captured here
+
+/// @brief Forwards request to the shard owning its room.
+/// @param room_name Room of the request.
+/// @param msg Request, sized by its type.
+/// @param cmsgid Client cmsgid.
+/// @return 1 if request was forwarded, 0 if this shard owns the room.
+int shardForward(char *room_name, void *msg, int cmsgid) {
+    int owner = mqipcShard(&shared->routing, room_name);
+    if (owner == shardId) {
+        return 0;
     }
-    // open temp database
-    FILE *temp = fopen(TEMP_DB, "w");
-    if (!temp) {
-        printError("Failed to open temp database.");
+    printf("Forwarding request from #%d to shard %d\n", cmsgid, owner);
+    requestForwarded = 1;
+    if (msgsnd(shared->routing.queues[owner], msg, mqipcPayloads[*(long *)msg], IPC_NOWAIT) == -1) {
+        // socket client waits as queue client would
+        if (errno == EAGAIN && gatewayUntake(cmsgid)) {
+            return 1;
+        }
+        printError("Failed to forward request.");
+        respondStatus(cmsgid, M_THROTTLED, "Server is busy, try again later.");
+    }
+    return 1;
+}
+
+/// @brief Opens capture file of this shard and writes its header.
+void traceOpen() {
+    char path[PATH_MAX];
+    if (shardId == 0) {
+        snprintf(path, sizeof(path), "%s", config.tracePath);
+    } else {
+        snprintf(path, sizeof(path), "%s.%d", config.tracePath, shardId);
+    }
+    trace = fopen(path, "wb");
+    if (!trace) {
+        printError("Failed to open trace file.");
         exit(1);
     }
-    // read database line by line
-    char name[32];
-    int id, key, userExists = 0;
-    while (fscanf(users, "%d %s %d", &id, name, &key) == 3) {
-        if (key == cmsgid) {
-            fprintf(temp, "%d %s %d\n", id, name, 0);
-            userExists = 1;
-        } else
-            fprintf(temp, "%d %s %d\n", id, name, key);
+    // records reach the file when the event loop goes idle
+    setvbuf(trace, NULL, _IOFBF, 1 << 20);
+    mqipc_trace_header header = {MQIPC_TRACE_MAGIC, MQIPC_TRACE_VERSION, shardId, config.shards};
+    fwrite(&header, sizeof(header), 1, trace);
+    traceDirty = 1;
+}
+
+/// @brief Captures client request handled by this shard.
+/// @param req Request.
+/// @param time Time request was taken (us).
+void traceWrite(request *req, long long time) {
+    mqipc_trace_record record = {time, sizeof(long) + mqipcPayloads[req->mtype]};
+    fwrite(&record, sizeof(record), 1, trace);
+    fwrite(req, record.length, 1, trace);
+    traceRecords++;
+    traceDirty = 1;
+}
+
+/// @brief Writes buffered records to capture file.
+void traceFlush() {
+    if (fflush(trace) == EOF) {
+        printError("Failed to write trace file.");
+    }
+    traceDirty = 0;
+}
+
+request requestRing[REQUEST_RING];  // filled by receiver thread, drained by event loop
+unsigned int requestHead = 0;       // next request to handle
+unsigned int requestTail = 0;       // next free slot
+pthread_mutex_t requestLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t requestSpace = PTHREAD_COND_INITIALIZER;
+int requestEvent = -1;              // eventfd signalled when event loop sleeps
+int loopSleeping = 0;               // event loop waits for eventfd, guarded by requestLock
+unsigned long loopSpinHits = 0;     // requests found by event loop while polling
+unsigned long receiverSpinHits = 0; // requests received while polling queue
+unsigned long latencyMessages = 0;  // published messages timed
+long long latencyQueue = 0;         // total time from publish to receive (us)
+long long latencyServer = 0;        // total time from receive to fan-out (us)
+unsigned long loopWakeups = 0;      // event loop wakeups
+unsigned long requestsHandled = 0;  // requests taken from ring
+
+/// @brief Receiver thread, hands requests from server queue to event loop.
+/// Polls the queue for config.spin after each request, then blocks in msgrcv.
+/// @param arg Server queue id.
+void *requestReceiver(void *arg) {
+    int msgid = (int)(intptr_t)arg;
+    long long spinUntil = 0;  // poll queue until then before blocking
+    while (1) {
+        // wait for free slot
+        pthread_mutex_lock(&requestLock);
+        while (requestTail - requestHead == REQUEST_RING) {
+            pthread_cond_wait(&requestSpace, &requestLock);
+        }
+        request *slot = &requestRing[requestTail % REQUEST_RING];
+        pthread_mutex_unlock(&requestLock);
+        // receive any request type, slot is not visible to event loop yet
+        ssize_t length = -1;
+        while (config.spin && nowUsec() < spinUntil) {
+            length = msgrcv(msgid, slot, sizeof(request) - sizeof(long), 0, IPC_NOWAIT);
+            if (length != -1) {
+                receiverSpinHits++;
+                break;
+            }
+            if (errno != ENOMSG && errno != EINTR) {
+                break;  // reported by blocking receive
+            }
+            sched_yield();  // let publishers run when cores are scarce
+        }
+        if (length == -1 && (length = msgrcv(msgid, slot, sizeof(request) - sizeof(long), 0, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == E2BIG) {
+                // oversized message stays first in queue, take it truncated to drop it
+                length = msgrcv(msgid, slot, sizeof(request) - sizeof(long), 0, MSG_NOERROR | IPC_NOWAIT);
+                fprintf(stderr, "Oversized request of type %ld dropped.\n", length == -1 ? 0 : slot->mtype);
+                continue;
+            }
+            if (errno == EIDRM || errno == EINVAL) {
+                return NULL;  // server shutting down
+            }
+            printError("Failed to receive request.");
+            exit(1);
+        }
+        long long now = nowUsec();
+        spinUntil = now + config.spin;
+        // handlers read every field of their type
+        if (!mqipcRequest(slot->mtype) || (size_t)length != mqipcPayloads[slot->mtype]) {
+            fprintf(stderr, "Invalid request of type %ld and %zd bytes dropped.\n", slot->mtype, length);
+            continue;
+        }
+        if (slot->mtype == M_SEND_MESSAGE) {
+            slot->msg_send_message.stamps[MQIPC_RECEIVED] = now;
+        }
+        requestTerminate(slot);
+        // signal event loop only if it sleeps
+        pthread_mutex_lock(&requestLock);
+        __atomic_store_n(&requestTail, requestTail + 1, __ATOMIC_RELEASE);
+        int wake = loopSleeping;
+        loopSleeping = 0;
+        pthread_mutex_unlock(&requestLock);
+        if (wake) {
+            uint64_t one = 1;
+            write(requestEvent, &one, sizeof(one));
+        }
     }
-    fclose(users);
-    fclose(temp);
-    if (userExists) {
-        // remove users database
-        remove(USERS_DB);
-        // rename temp database
-        rename(TEMP_DB, USERS_DB);
+    return NULL;
+}
+
+/// @brief Takes next received request.
+/// @param req Request copy.
+/// @return 1 if request was taken, 0 if none is waiting.
+int requestTake(request *req) {
+    pthread_mutex_lock(&requestLock);
+    loopSleeping = 0;
+    if (requestHead == requestTail) {
+        pthread_mutex_unlock(&requestLock);
+        return 0;
     }
+    int full = requestTail - requestHead == REQUEST_RING;
+    *req = requestRing[requestHead % REQUEST_RING];
+    requestHead++;
+    if (full) {
+        pthread_cond_signal(&requestSpace);
+    }
+    pthread_mutex_unlock(&requestLock);
+    return 1;
 }
 
-/// @brief Checks if room exists.
-/// @param room_name Room name.
-/// @return Room id if room exists, negative value of next id otherwise.
-int dbRoomExists(char *room_name) {
-    // open rooms database
-    FILE *rooms = fopen(ROOMS_DB, "r");
-    if (!rooms) {
-        printError("Failed to open rooms database.");
+/// @brief Waits for receiver thread to queue a request, polling within config.spin of last request.
+/// @param last Time last request was handled (us).
+/// @return 1 if request is waiting, 0 if event loop should sleep.
+int requestSpin(long long last) {
+    while (config.spin && nowUsec() - last < config.spin) {
+        if (__atomic_load_n(&requestTail, __ATOMIC_ACQUIRE) != requestHead) {
+            loopSpinHits++;
+            return 1;
+        }
+        sched_yield();
+    }
+    // receiver signals eventfd from now on
+    pthread_mutex_lock(&requestLock);
+    int waiting = requestHead != requestTail;
+    loopSleeping = !waiting;
+    pthread_mutex_unlock(&requestLock);
+    return waiting;
+}
+
+/// @brief Arms one-shot timer.
+/// @param fd Timer.
+/// @param due Expiration time on monotonic clock (us), 0 disarms timer.
+void timerArm(int fd, long long due) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = due / 1000000;
+    spec.it_value.tv_nsec = due % 1000000 * 1000;
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/// @brief Creates event source and adds it to event loop.
+/// @param epfd Event loop.
+/// @param fd Event source, -1 on creation failure.
+/// @param event Event source tag.
+/// @return Event source.
+int loopAdd(int epfd, int fd, int event) {
+    struct epoll_event ev = {EPOLLIN, {.u32 = event}};
+    if (fd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        printError("Failed to create event source.");
         exit(1);
     }
-    // read database line by line
-    char name[32];
-    int id = 0;
-    while (fscanf(rooms, "%d %s", &id, name) == 2) {
-        if (strcmp(name, room_name) == 0) {
-            fclose(rooms);
-            return id;  // Room exists
+    return fd;
+}
+
+void handleLogout(msg_logout *msg) {
+    printf("Received logout message from user: #%d\n", msg->cmsgid);
+    // delete user from database
+    dbRemoveUser(msg->cmsgid);
+    session *ses = sessionFind(msg->cmsgid);
+    if (ses) {
+        sessionRemove(ses);
+    }
+}
+
+void handleLogin(msg_login *msg) {
+    printf("Received login message from user: %s #%d\n", msg->username, msg->cmsgid);
+    // release username held by a dead client
+    session *holder = sessionSlot(msg->username, NULL);
+    if (holder && holder->cmsgid != msg->cmsgid && !sessionAlive(holder)) {
+        sessionReap(holder);
+    }
+    // add user to database
+    int id = dbAddUser(msg->username, msg->cmsgid);
+    // check if user exists
+    if (id == -1) {
+        limitRejected++;
+        respondStatus(msg->cmsgid, M_LIMITED, "Too many users.");
+    } else if (id != msg->cmsgid && id != 0) {
+        respondStatus(msg->cmsgid, M_FAIL, "Username is taken.");
+    } else {
+        sessionAdd(msg->username, msg->cmsgid, msg->pid, msg->flags & MQIPC_LOGIN_BATCH);
+        respondStatus(msg->cmsgid, M_SUCCESS, "Login successful.");
+    }
+}
+
+void handleCreateRoom(msg_create_room *msg) {
+    printf("Received create room message from user: #%d\n", msg->cmsgid);
+    if (shardForward(msg->room_name, msg, msg->cmsgid)) {
+        return;
+    }
+    int id = dbAddRoom(msg->room_name);
+    if (id == -1) {
+        limitRejected++;
+        respondStatus(msg->cmsgid, M_LIMITED, "Too many rooms.");
+    } else if (id) {
+        // room exists
+        respondStatus(msg->cmsgid, M_FAIL, "Room name is taken.");
+    } else {
+        // room created
+        respondStatus(msg->cmsgid, M_SUCCESS, "Room created.");
+    }
+}
+
+void handleListRooms(msg_list_rooms *msg) {
+    printf("Received list rooms message from user: #%d\n", msg->cmsgid);
+    int key = MQIPC_MESSAGE_SIZE / 32;
+    // define response
+    msg_response *response = arenaAlloc(&requestArena, sizeof(msg_response));
+    response->status = M_SUCCESS;
+    response->mtype = M_RESPONSE;
+    strcpy(response->message, "");
+    // socket clients reach shard 0 only, it lists the rooms every shard published
+    int socketClient = msg->cmsgid < 0;
+    for (int s = 0; s < (socketClient ? config.shards : 1); s++) {
+        int count = socketClient ? __atomic_load_n(&shared->roomsListed[s], __ATOMIC_ACQUIRE) : db->roomCount;
+        for (int i = 0; i < count; i++) {
+            strcat(response->message, socketClient ? shared->roomNames[s][i] : db->rooms[i].name);
+            if (!(--key)) {
+                response->status = M_MORE;
+                respond(msg->cmsgid, response);
+                key = MQIPC_MESSAGE_SIZE / 32;
+                strcpy(response->message, "");
+                continue;
+            }
+            strcat(response->message, " ");
         }
     }
-    // close rooms database
-    fclose(rooms);
-    return -(++id);
+    response->status = M_SUCCESS;
+    respond(msg->cmsgid, response);
 }
 
-int dbAddRoom(char *room_name) {
-    int tmp = dbRoomExists(room_name);
-    if (tmp > 0) {
-        return tmp;
+void handleJoinRoom(msg_join_room *msg) {
+    printf("Received join room message from user: #%d\n", msg->cmsgid);
+    if (shardForward(msg->room_name, msg, msg->cmsgid)) {
+        return;
     }
-    // open rooms database
-    FILE *rooms = fopen(ROOMS_DB, "a");
-    if (!rooms) {
-        printError("Failed to open rooms database.");
-        exit(1);
+    switch (dbJoinRoom(msg->room_name, msg->username, msg->subscribtion, config.maxSubscribers)) {
+        case -1:
+            limitRejected++;
+            respondStatus(msg->cmsgid, M_LIMITED, "Too many subscribtions.");
+            break;
+        case -2:
+            limitRejected++;
+            respondStatus(msg->cmsgid, M_LIMITED, "Room is full.");
+            break;
+        case 1:
+            respondStatus(msg->cmsgid, M_FAIL, "Room does not exist.");
+            break;
+        case 2:
+            respondStatus(msg->cmsgid, M_SUCCESS, "Changed room subscribtion.");
+            break;
+        default:
+            respondStatus(msg->cmsgid, M_SUCCESS, "Room joined.");
+            break;
     }
-    fprintf(rooms, "%d %s\n", -tmp, room_name);
-    // close rooms database
-    fclose(rooms);
-    return 0;
 }
 
-int dbEditRoom(int roomid, char *username, int sub) {
-    // open keys database
-    FILE *keys = fopen(KEYS_DB, "r");
-    if (!keys) {
-        printError("Failed to open keys database.");
-        exit(1);
+void handleSendMessage(msg_send_message *msg) {
+    int sender = msg->cmsgid;
+    printf("Received send message message from user: #%d\n", sender);
+    // priority becomes mtype of delivered message, clients receive up to MQIPC_MAX_PRIORITY
+    if (msg->priority < 1 || msg->priority > MQIPC_MAX_PRIORITY) {
+        respondStatus(sender, M_FAIL, "Priority must be between 1 and 10.");
+        return;
     }
-    // open temp database
-    FILE *temp = fopen(TEMP_DB, "w");
-    if (!temp) {
-        printError("Failed to open temp database.");
-        exit(1);
+    if (shardForward(msg->room_name, msg, sender)) {
+        return;
     }
-    // read database line by line
-    char usr[32];
-    int id, subscribtion, edit = 0;
-    while (fscanf(keys, "%d %s %d", &id, usr, &subscribtion) == 3) {
-        if (id == roomid && strcmp(usr, username) == 0) {
-            fprintf(temp, "%d %s %d\n", id, usr, sub);
-            edit = 1;
-        } else {
-            fprintf(temp, "%d %s %d\n", id, usr, subscribtion);
+    // check if room exists
+    db_room *room = dbRoomFind(msg->room_name);
+    if (!room) {
+        respondStatus(sender, M_FAIL, "Room does not exist.");
+        return;
+    }
+    // author is the user logged in from the sending client, rate limits key on it
+    session author;
+    if (!sessionByName(msg->author, &author) || author.cmsgid != sender) {
+        respondStatus(sender, M_FAIL, "Author is not logged in from this client.");
+        return;
+    }
+    // check publish rate before fan-out
+    int limited = rateLimit(msg->author, msg->room_name);
+    if (limited) {
+        respondStatus(sender, M_THROTTLED, limited == 1 ? "Sending too fast, try again later." : "Room is too busy, try again later.");
+        return;
+    }
+    // received message is shared by all deliveries
+    msg_buffer *buf = bufferAlloc();
+    buf->msg = *msg;
+    buf->msg.mtype = buf->msg.priority;
+    buf->msg.cmsgid = 0;
+    buf->msg.sequence = ++room->sequence;
+    buf->msg.stamps[MQIPC_FANOUT] = nowUsec();
+    if (buf->msg.stamps[MQIPC_PUBLISHED] && buf->msg.stamps[MQIPC_PUBLISHED] <= buf->msg.stamps[MQIPC_RECEIVED]) {
+        latencyQueue += buf->msg.stamps[MQIPC_RECEIVED] - buf->msg.stamps[MQIPC_PUBLISHED];
+        latencyServer += buf->msg.stamps[MQIPC_FANOUT] - buf->msg.stamps[MQIPC_RECEIVED];
+        latencyMessages++;
+    }
+    int roomid = room->id;
+    // deliver to room subscribers
+    for (int i = 0; i < db->keyCount; i++) {
+        db_key *key = &db->keys[i];
+        if (key->room != roomid) {
+            continue;
+        }
+        if (key->subscribtion != -1) {
+            key->subscribtion--;
+            dbChanged(DB_KEYS);
+        }
+        // check if still valid subscribtion
+        if (key->subscribtion == 0) {
+            dbRemoveKey(i--);
+            continue;
+        }
+        // deliver only to live clients
+        session ses;
+        if (sessionByName(key->user, &ses) && !ses.dead) {
+            // broadcast the message to users
+            deliverMessage(&ses, buf);
         }
     }
-    fclose(keys);
-    fclose(temp);
-    if (edit) {
-        // remove keys database
-        remove(KEYS_DB);
-        // rename temp database
-        rename(TEMP_DB, KEYS_DB);
-        return 0;  // User is in room
+    // drop publisher reference, deliveries keep their own
+    bufferRelease(buf);
+    // response with success
+    respondStatus(sender, M_SUCCESS, "Message sent.");
+}
+
+/// @brief Passes message handled by other shard to socket client.
+void handleGatewayDeliver(msg_gateway_deliver *msg) {
+    if (msg->length < (int)sizeof(long) || msg->length > (int)sizeof(msg->data)) {
+        fprintf(stderr, "Invalid gateway delivery of %d bytes.\n", msg->length);
+        return;
     }
-    return 1;  // User is not in room
+    // output grows past its limit, other shards can not retry
+    gatewaySend(msg->cmsgid, msg->data, msg->length - sizeof(long), 1);
 }
 
-int dbJoinRoom(char *room_name, char *username, int subscribtion) {
-    // find room id
-    int key = dbRoomExists(room_name);
-    if (key < 0) {
-        return 1;  // Room does not exist
+/// @brief Takes messages other shards passed for socket clients.
+void gatewayReceive() {
+    msg_gateway_deliver deliver;
+    ssize_t size;
+    while ((size = recv(gatewayChannel[0], &deliver, sizeof(deliver), MSG_DONTWAIT)) != -1) {
+        if (size < (ssize_t)offsetof(msg_gateway_deliver, data) || deliver.mtype != M_GATEWAY_DELIVER ||
+            size != (ssize_t)offsetof(msg_gateway_deliver, data) + deliver.length) {
+            fprintf(stderr, "Invalid gateway delivery of %zd bytes.\n", size);
+            continue;
+        }
+        handleGatewayDeliver(&deliver);
     }
-    // edit room if user is already in it
-    if (!dbEditRoom(key, username, subscribtion)) {
-        return 2;  // User is in room
+}
+
+typedef void (*request_handler)(request *req);
+
+// typed handler entry points, one per catalogue request
+#define REQUEST_DISPATCH(type, value, layout, name) \
+    void dispatch##name(request *req) {             \
+        handle##name(&req->layout);                 \
     }
-    // open keys database
-    FILE *keys = fopen(KEYS_DB, "a");
-    if (!keys) {
-        printError("Failed to open keys database.");
-        exit(1);
+MQIPC_REQUESTS(REQUEST_DISPATCH)
+#undef REQUEST_DISPATCH
+
+/// @brief Request handlers by message type.
+request_handler handlers[M_TYPES] = {
+#define REQUEST_HANDLER(type, value, layout, name) [type] = dispatch##name,
+    MQIPC_REQUESTS(REQUEST_HANDLER)
+#undef REQUEST_HANDLER
+};
+
+/// @brief Prints server diagnostics.
+void printStats() {
+    printf("Allocator statistics:\n");
+    for (int i = 0; i < poolCount; i++) {
+        pool *p = &pools[i];
+        printf("  pool %4zu B: %lu slabs, %lu in use, %lu peak, %lu allocs, %lu frees\n", p->size, p->slabs, p->used, p->peak, p->allocs, p->frees);
     }
-    fprintf(keys, "%d %s %d\n", key, username, subscribtion);
-    // close keys database
-    fclose(keys);
-    return 0;
+    printf("  request arena: %lu blocks, %zu B peak, %lu allocs, %lu requests\n", requestArena.blocks, requestArena.peak, requestArena.allocs, requestArena.resets);
+    if (config.shards > 1) {
+        printf("Shard %d of %d:\n", shardId, config.shards);
+    }
+    if (shardId == 0) {
+        printf("Sessions: %lu live, %lu dead clients removed\n", shared->sessionsLive, shared->sessionsReaped);
+    }
+    printf("Database: %lu commits, %lu requests committed", commits, commitRequests);
+    if (commits) {
+        printf(", %.1f requests per commit", (double)commitRequests / commits);
+    }
+    printf("\n");
+    printf("Throttled messages: %lu by author limit, %lu by room limit, %d author and %d room buckets\n", throttledAuthor, throttledRoom, authorBucketCount, roomBucketCount);
+    if (shardId == 0) {
+        printf("Limits: %d of %d users, %d of %d rooms", db->userCount, config.maxUsers, __atomic_load_n(&shared->rooms, __ATOMIC_RELAXED), config.maxRooms);
+    } else {
+        printf("Limits: %d rooms here, %d of %d rooms", db->roomCount, __atomic_load_n(&shared->rooms, __ATOMIC_RELAXED), config.maxRooms);
+    }
+    printf(", %d of %d subscriptions, %d subscribers per room, %lu requests rejected\n", db->keyCount, DB_MAX_KEYS, config.maxSubscribers, limitRejected);
+    printf("Buffered: %ld B now, %ld B peak, %d B per subscriber, %lu deliveries dropped\n", bufferedBytes, bufferedPeak, config.maxBuffered, bufferDropped);
+    printf("Delivery: %lu messages, %lu msgsnd calls, %lu batch frames", deliveries, deliverySends, batchFrames);
+    if (deliveries) {
+        printf(", %.3f msgsnd per message", (double)deliverySends / deliveries);
+    }
+    printf("\n");
+    printf("Event loop: %lu wakeups, %lu requests", loopWakeups, requestsHandled);
+    if (loopWakeups) {
+        printf(", %.1f requests per wakeup", (double)requestsHandled / loopWakeups);
+    }
+    printf("\n");
+    // latency bought with CPU time by polling
+    printf("Receive: %d us polling, %lu requests found by event loop polling, %lu by receiver polling\n", config.spin, loopSpinHits, receiverSpinHits);
+    if (latencyMessages) {
+        printf("Latency: %.1f us publish to receive, %.1f us receive to fan-out, %lu messages\n", (double)latencyQueue / latencyMessages, (double)latencyServer / latencyMessages, latencyMessages);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    double wall = (nowUsec() - serverStart) / 1e6;
+    printf("CPU: %.2f s user, %.2f s system, %.1f%% of one core over %.1f s\n", user, system, wall > 0 ? 100 * (user + system) / wall : 0, wall);
+    if (trace) {
+        printf("Capture: %lu requests\n", traceRecords);
+    }
+    if (gatewayChannel[1] != -1) {
+        printf("Gateway: %lu messages passed to shard 0, %lu not taken in time\n", gatewayPassed, gatewayPassBusy);
+    }
+    if (gatewayListeners[0] != -1 || gatewayListeners[1] != -1) {
+        printf("Gateway: %lu connections, %lu frames, %lu writev calls", gatewayAccepted, gatewayFrames, gatewayWrites);
+        if (gatewayWrites) {
+            printf(", %.1f frames per call", (double)gatewayFrames / gatewayWrites);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/// @brief Prints diagnostics of this shard, shard 0 passes the request on to other shards.
+void statsRequest() {
+    for (int s = 1; shardId == 0 && s < config.shards; s++) {
+        kill(shardPids[s], SIGUSR1);
+    }
+    printStats();
 }
 
 int gid = 0;
-void exitHandler(int sig) {
-    printf("Server shutting down.\n");
+void serverShutdown() {
+    if (shardId == 0) {
+        // stop other shards first
+        for (int s = 1; s < config.shards; s++) {
+            kill(shardPids[s], SIGINT);
+            waitpid(shardPids[s], NULL, 0);
+        }
+        printf("Server shutting down.\n");
+    }
+    dbCommit(responsesDeferred);
+    responseFlush();
+    if (trace) {
+        traceFlush();
+    }
+    printStats();
     msgctl(gid, IPC_RMID, 0);
+    if (shardId == 0) {
+        shmctl(sharedId, IPC_RMID, NULL);
+        if (config.gatewayPath) {
+            unlink(config.gatewayPath);
+        }
+    }
     exit(0);
 }
 
-int main(int argc, char const *argv[]) {
+int main(int argc, char *const argv[]) {
+    // read settings
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:d:l:r:R:s:t:T:u:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                config.batchBytes = atoi(optarg);
+                break;
+            case 'c':
+                config.cpu = atoi(optarg);
+                break;
+            case 'd':
+                config.batchDelay = atoi(optarg);
+                break;
+            case 'l':
+                parseLimits(optarg);
+                break;
+            case 'r':
+                parseRate(optarg, &config.authorRate, &config.authorBurst);
+                break;
+            case 'R':
+                parseRate(optarg, &config.roomRate, &config.roomBurst);
+                break;
+            case 's':
+                config.shards = atoi(optarg);
+                break;
+            case 't':
+                config.gatewayPort = atoi(optarg);
+                break;
+            case 'T':
+                config.tracePath = optarg;
+                break;
+            case 'u':
+                config.gatewayPath = optarg;
+                break;
+            case 'w':
+                config.spin = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b batch_bytes] [-c cpu] [-d batch_delay_us] [-l users:rooms:subscribers:buffered_bytes] [-r author_rate[:burst]] [-R room_rate[:burst]] [-s shards] [-t gateway_port] [-T trace_file] [-u gateway_socket] [-w spin_us]\n", argv[0]);
+                return 1;
+        }
+    }
+    // batch frame must fit the largest message
+    if (config.batchBytes > MQIPC_BATCH_SIZE) {
+        config.batchBytes = MQIPC_BATCH_SIZE;
+    }
+    if (config.batchBytes && config.batchBytes < (int)(sizeof(msg_batch_entry) + 31 + 31 + MQIPC_MESSAGE_SIZE - 1)) {
+        config.batchBytes = sizeof(msg_batch_entry) + 31 + 31 + MQIPC_MESSAGE_SIZE - 1;
+    }
+    // limits stay within table capacity, a subscriber can always buffer its largest message
+    if (config.maxUsers > DB_MAX_USERS) {
+        config.maxUsers = DB_MAX_USERS;
+    }
+    if (config.maxRooms > DB_MAX_ROOMS * config.shards) {
+        config.maxRooms = DB_MAX_ROOMS * config.shards;
+    }
+    if (config.maxBuffered < (int)(sizeof(msg_batch_entry) + 31 + 31 + MQIPC_MESSAGE_SIZE - 1)) {
+        config.maxBuffered = sizeof(msg_batch_entry) + 31 + 31 + MQIPC_MESSAGE_SIZE - 1;
+    }
+    if (config.shards < 1 || config.shards > MQIPC_MAX_SHARDS) {
+        fprintf(stderr, "Number of shards must be between 1 and %d.\n", MQIPC_MAX_SHARDS);
+        return 1;
+    }
     printf("Welcome to Message Queue IPC Server\n");
     printf("CTRL+C to exit.\n");
     // initialize database
     dbInit();
-    // create server queue
-    int msgid = msgget(MQIPC_SERVER, 0666 | IPC_CREAT);
-    // register exit handler
-    signal(SIGINT, exitHandler);
+    // initialize allocator
+    allocInit();
+    // create routing table and shard queues
+    sharedInit();
+    for (int s = 0; s < config.shards; s++) {
+        shared->routing.queues[s] = msgget(MQIPC_SERVER + s, 0666 | IPC_CREAT);
+        // check for errors
+        if (shared->routing.queues[s] == -1) {
+            printError("Failed to create server queue.");
+            shmctl(sharedId, IPC_RMID, NULL);
+            return 1;
+        }
+    }
+    database *tables[MQIPC_MAX_SHARDS];
+    shardBalance(tables);
+    // signals are handled by event loop of every shard
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    // other shards pass messages for socket clients to shard 0, never over a public queue
+    if (config.shards > 1 && (config.gatewayPath || config.gatewayPort) &&
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, gatewayChannel) == -1) {
+        printError("Failed to create gateway channel.");
+        exit(1);
+    }
+    // start other shards
+    shardPids[0] = getpid();
+    fflush(stdout);
+    for (int s = 1; s < config.shards; s++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            printError("Failed to start shard.");
+            exit(1);
+        }
+        if (pid == 0) {
+            shardId = s;
+            break;
+        }
+        shardPids[s] = pid;
+    }
+    db = tables[shardId];
+    dbRoomNames = shared->roomNames[shardId];
+    dbRoomsListed = &shared->roomsListed[shardId];
+    shardDir(shardId, dbDir);
+    for (int s = 1; s < MQIPC_MAX_SHARDS; s++) {
+        if (s != shardId) {
+            free(tables[s]);
+        }
+    }
+    int msgid = shared->routing.queues[shardId];
     gid = msgid;
-    // check for errors
-    if (msgid == -1) {
-        printError("Failed to create server queue.");
-        return 1;
+    serverStart = nowUsec();
+    if (config.tracePath) {
+        traceOpen();
+    }
+    // restore sessions and drop the ones whose clients are gone
+    int lostSeen = 0;
+    if (shardId == 0) {
+        sessionLoad();
+        sessionSweep();
+    }
+    // requests, signals and timers wake one event loop
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        printError("Failed to create event loop.");
+        exit(1);
+    }
+    eventLoop = epfd;
+    requestEvent = loopAdd(epfd, eventfd(0, EFD_NONBLOCK), EVENT_REQUEST);
+    int signals = loopAdd(epfd, signalfd(-1, &mask, SFD_NONBLOCK), EVENT_SIGNAL);
+    int flushTimer = loopAdd(epfd, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK), EVENT_FLUSH);
+    int livenessTimer = -1;
+    if (shardId == 0) {
+        livenessTimer = loopAdd(epfd, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK), EVENT_LIVENESS);
+        struct itimerspec interval = {{LIVENESS_INTERVAL, 0}, {LIVENESS_INTERVAL, 0}};
+        timerfd_settime(livenessTimer, 0, &interval, NULL);
+        // socket clients connect to shard 0
+        gatewayListen();
+        if (gatewayChannel[0] != -1) {
+            close(gatewayChannel[1]);
+            gatewayChannel[1] = -1;
+            loopAdd(epfd, gatewayChannel[0], EVENT_DELIVER);
+        }
+    } else if (gatewayChannel[0] != -1) {
+        close(gatewayChannel[0]);
+        gatewayChannel[0] = -1;
+    }
+    // receive requests in background, SysV queues can not be polled
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, requestReceiver, (void *)(intptr_t)msgid) != 0) {
+        printError("Failed to start request receiver.");
+        exit(1);
+    }
+    // pin event loop, receiver thread stays unpinned
+    if (config.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((config.cpu + shardId) % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Failed to pin shard %d to CPU.\n", shardId);
+        }
+    }
+    if (config.shards > 1) {
+        printf("Shard %d started at %d\n", shardId, msgid);
+    } else {
+        printf("Server started at %d\n", msgid);
     }
-    printf("Server started at %d\n", msgid);
     // listen for messages
     int listen = 1;
-    msg_login msg_temp_login;
-    msg_create_room msg_temp_create_room;
-    msg_logout msg_temp_logout;
-    msg_list_rooms msg_temp_list_rooms;
-    msg_join_room msg_temp_join_room;
-    msg_send_message msg_temp_send_message;
+    request req;
+    request captured;           // request as taken, before handling
+    long long flushDue = 0;     // flush timer expiration, 0 when disarmed
+    long long lastRequest = 0;  // time last request was taken, for polling
     while (listen) {
-        // check for logout messages
-        if (msgrcv(msgid, &msg_temp_logout, sizeof(msg_temp_logout), M_LOGOUT, IPC_NOWAIT) != -1) {
-            printf("Received logout message from user: #%d\n", msg_temp_logout.cmsgid);
-            // delete user from database
-            dbRemoveUser(msg_temp_logout.cmsgid);
-        }
-        // check for login messages
-        if (msgrcv(msgid, &msg_temp_login, sizeof(msg_temp_login), M_LOGIN, IPC_NOWAIT) != -1) {
-            printf("Received login message from user: %s #%d\n", msg_temp_login.username, msg_temp_login.cmsgid);
-            // add user to database
-            int id = dbAddUser(msg_temp_login.username, msg_temp_login.cmsgid);
-            // define response
-            msg_response response;
-            // check if user exists
-            if (id != msg_temp_login.cmsgid && id != 0) {
-                response.status = M_FAIL;
-                response.mtype = M_RESPONSE;
-                strcpy(response.message, "Username is taken.");
-            } else {
-                response.status = M_SUCCESS;
-                response.mtype = M_RESPONSE;
-                strcpy(response.message, "Login successful.");
-            }
-            printf("Sending response to: %d\n", msg_temp_login.cmsgid);
-            if (msgsnd(msg_temp_login.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                printError("Failed to send login response.");
-            }
+        int taken = requestTake(&req) || gatewayTake(&req);
+        // group commit once requests stop arriving or the oldest change waited long enough
+        if (dbDirty && (!taken || responsesDeferred >= COMMIT_MAX || nowUsec() - commitSince >= COMMIT_DELAY)) {
+            dbCommit(responsesDeferred);
+            responseFlush();
         }
-        // check for create room messages
-        if (msgrcv(msgid, &msg_temp_create_room, sizeof(msg_temp_create_room), M_CREATE_ROOM, IPC_NOWAIT) != -1) {
-            printf("Received create room message from user: #%d\n", msg_temp_create_room.cmsgid);
-            int id = dbAddRoom(msg_temp_create_room.room_name);
-            msg_response response;
-            if (id) {
-                // room exists
-                response.status = M_FAIL;
-                response.mtype = M_RESPONSE;
-                strcpy(response.message, "Room name is taken.");
-            } else {
-                // room created
-                response.status = M_SUCCESS;
-                response.mtype = M_RESPONSE;
-                strcpy(response.message, "Room created.");
-            }
-            printf("Sending response to: %d\n", msg_temp_create_room.cmsgid);
-            if (msgsnd(msg_temp_create_room.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                printError("Failed to send create room response.");
-            }
+        // retry messages for subscribers with full queues
+        long long due = overflows ? overflowFlush() : 0;
+        long long retry = gatewayWaiting ? gatewayRetry() : 0;
+        if (retry && (!due || retry < due)) {
+            due = retry;
         }
-        // check for list rooms messages
-        if (msgrcv(msgid, &msg_temp_list_rooms, sizeof(msg_temp_list_rooms), M_LIST_ROOMS, IPC_NOWAIT) != -1) {
-            printf("Received list rooms message from user: #%d\n", msg_temp_list_rooms.cmsgid);
-            // open rooms database
-            FILE *rooms = fopen(ROOMS_DB, "r");
-            if (!rooms) {
-                printError("Failed to open rooms database.");
-                exit(1);
-            }
-            // read database line by line
-            char name[32];
-            int id = 0, key = MQIPC_MESSAGE_SIZE / 32;
-            // define response
-            msg_response response;
-            response.status = M_SUCCESS;
-            response.mtype = M_RESPONSE;
-            strcpy(response.message, "");
-            while (fscanf(rooms, "%d %s", &id, name) == 2) {
-                strcat(response.message, name);
-                if (!(--key)) {
-                    response.status = M_MORE;
-                    printf("Sending response to: %d\n", msg_temp_list_rooms.cmsgid);
-                    if (msgsnd(msg_temp_list_rooms.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                        printError("Failed to send list rooms response.");
-                    }
-                    key = MQIPC_MESSAGE_SIZE / 32;
-                    strcpy(response.message, "");
-                    continue;
-                }
-                strcat(response.message, " ");
-            }
-            response.status = M_SUCCESS;
-            printf("Sending response to: %d\n", msg_temp_list_rooms.cmsgid);
-            if (msgsnd(msg_temp_list_rooms.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                printError("Failed to send list rooms response.");
+        if (due != flushDue) {
+            timerArm(flushTimer, due);
+            flushDue = due;
+        }
+        if (!taken) {
+            // write socket client output gathered while handling requests
+            if (gatewayChannel[0] != -1) {
+                gatewayReceive();
             }
-            // close rooms database
-            fclose(rooms);
-        }
-        // check for join room messages
-        if (msgrcv(msgid, &msg_temp_join_room, sizeof(msg_temp_join_room), M_JOIN_ROOM, IPC_NOWAIT) != -1) {
-            printf("Received join room message from user: #%d\n", msg_temp_join_room.cmsgid);
-            int id = dbJoinRoom(msg_temp_join_room.room_name, msg_temp_join_room.username, msg_temp_join_room.subscribtion);
-            msg_response response;
-            switch (id) {
-                case 1:
-                    response.status = M_FAIL;
-                    response.mtype = M_RESPONSE;
-                    strcpy(response.message, "Room does not exist.");
-                    break;
-                case 2:
-                    response.status = M_SUCCESS;
-                    response.mtype = M_RESPONSE;
-                    strcpy(response.message, "Changed room subscribtion.");
-                    break;
-                default:
-                    response.status = M_SUCCESS;
-                    response.mtype = M_RESPONSE;
-                    strcpy(response.message, "Room joined.");
-                    break;
+            gatewayFlush();
+            if (traceDirty) {
+                traceFlush();
             }
-            printf("Sending response to: %d\n", msg_temp_join_room.cmsgid);
-            if (msgsnd(msg_temp_join_room.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                printError("Failed to send join room response.");
+            // reap sessions other shards found dead
+            if (shardId == 0 && __atomic_load_n(&shared->lost, __ATOMIC_ACQUIRE) != lostSeen) {
+                lostSeen = __atomic_load_n(&shared->lost, __ATOMIC_ACQUIRE);
+                sessionSweep();
             }
-        }
-        // check for send message messages
-        if (msgrcv(msgid, &msg_temp_send_message, sizeof(msg_temp_send_message), M_SEND_MESSAGE, IPC_NOWAIT) != -1) {
-            printf("Received send message message from user: #%d\n", msg_temp_send_message.cmsgid);
-            // check if room exists
-            int roomid = dbRoomExists(msg_temp_send_message.room_name);
-            if (roomid < 0) {
-                msg_response response;
-                response.status = M_FAIL;
-                response.mtype = M_RESPONSE;
-                strcpy(response.message, "Room does not exist.");
-                printf("Sending response to: %d\n", msg_temp_send_message.cmsgid);
-                if (msgsnd(msg_temp_send_message.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                    printError("Failed to send send message response.");
-                }
+            // poll for next request a while after the last one
+            if (requestSpin(lastRequest)) {
                 continue;
             }
-            // get room users
-            FILE *keys = fopen(KEYS_DB, "r");
-            if (!keys) {
-                printError("Failed to open keys database.");
-                exit(1);
-            }
-            FILE *temp = fopen(TEMP_DB, "w");
-            if (!temp) {
-                printError("Failed to open temp database.");
+            // sleep until next request, signal or timer
+            struct epoll_event events[4];
+            int count = epoll_wait(epfd, events, 4, -1);
+            if (count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                printError("Failed to wait for events.");
                 exit(1);
             }
-            // read database line by line
-            char usr[32];
-            int id, subscribtion;
-            while (fscanf(keys, "%d %s %d", &id, usr, &subscribtion) == 3) {
-                if (id == roomid) {
-                    if (subscribtion != -1) {
-                        subscribtion--;
-                    }
-                    // check if still valid subscribtion
-                    if (subscribtion != 0) {
-                        fprintf(temp, "%d %s %d\n", id, usr, subscribtion);
-                        // get user cmsgid
-                        int cmsgid = dbUserExists(usr);
-                        if (cmsgid > 0) {
-                            // broadcast the message to users
-                            printf("Sending message to: %d\n", cmsgid);
-                            msg_send_message usermsg;
-                            usermsg.mtype = msg_temp_send_message.priority;
-                            strcpy(usermsg.author, msg_temp_send_message.author);
-                            strcpy(usermsg.room_name, msg_temp_send_message.room_name);
-                            strcpy(usermsg.message, msg_temp_send_message.message);
-                            usermsg.cmsgid = 0;
-                            if (msgsnd(cmsgid, &usermsg, sizeof(msg_send_message), IPC_NOWAIT) == -1) {
-                                printError("Failed to send message.");
+            loopWakeups++;
+            for (int i = 0; i < count; i++) {
+                uint64_t value;
+                struct signalfd_siginfo info;
+                switch (events[i].data.u32) {
+                    case EVENT_REQUEST:
+                        read(requestEvent, &value, sizeof(value));
+                        break;
+                    case EVENT_FLUSH:
+                        read(flushTimer, &value, sizeof(value));
+                        flushDue = 0;
+                        break;
+                    case EVENT_LIVENESS:
+                        // check client liveness
+                        read(livenessTimer, &value, sizeof(value));
+                        sessionSweep();
+                        break;
+                    case EVENT_SIGNAL:
+                        while (read(signals, &info, sizeof(info)) == sizeof(info)) {
+                            if (info.ssi_signo == SIGINT) {
+                                serverShutdown();
+                            } else if (info.ssi_signo == SIGUSR1) {
+                                statsRequest();
                             }
+                            // SIGUSR2 only wakes loop to reap lost sessions
+                        }
+                        break;
+                    case EVENT_LISTEN:
+                        gatewayAccept();
+                        break;
+                    case EVENT_DELIVER:
+                        gatewayReceive();
+                        break;
+                    default: {
+                        gateway_connection *conn = &gateway[events[i].data.u32 - EVENT_CONNECTION];
+                        if (events[i].events & EPOLLOUT && conn->fd != -1) {
+                            gatewayWrite(conn);
+                        }
+                        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && conn->fd != -1 && !conn->paused) {
+                            gatewayRead(conn);
                         }
+                        break;
                     }
-                } else {
-                    fprintf(temp, "%d %s %d\n", id, usr, subscribtion);
                 }
             }
-            fclose(keys);
-            fclose(temp);
-            // remove keys database
-            remove(KEYS_DB);
-            // rename temp database
-            rename(TEMP_DB, KEYS_DB);
-            // response with success
-            msg_response response;
-            response.status = M_SUCCESS;
-            response.mtype = M_RESPONSE;
-            strcpy(response.message, "Message sent.");
-            printf("Sending response to: %d\n", msg_temp_send_message.cmsgid);
-            if (msgsnd(msg_temp_send_message.cmsgid, &response, sizeof(msg_response), IPC_NOWAIT) == -1) {
-                printError("Failed to send send message response.");
-            }
+            continue;
+        }
+        requestsHandled++;
+        // deliveries of other shards do not wait for the event loop to go idle
+        if (gatewayChannel[0] != -1 && requestsHandled % GATEWAY_RECEIVE == 0) {
+            gatewayReceive();
+        }
+        if (config.spin || trace) {
+            lastRequest = nowUsec();
+        }
+        // snapshot client request, handlers may fill in fields
+        int capture = trace && mqipcRequest(req.mtype);
+        if (capture) {
+            memcpy(&captured, &req, sizeof(long) + mqipcPayloads[req.mtype]);
+        }
+        // handle request by its type
+        requestForwarded = 0;
+        if (req.mtype > 0 && req.mtype < M_TYPES && handlers[req.mtype]) {
+            handlers[req.mtype](&req);
+        } else {
+            fprintf(stderr, "Unknown request type %ld.\n", req.mtype);
+        }
+        // capture client requests once, in the shard owning them
+        if (capture && !requestForwarded) {
+            traceWrite(&captured, lastRequest);
         }
+        arenaReset(&requestArena);
     }
     return 0;
 }